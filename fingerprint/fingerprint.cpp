@@ -4,10 +4,13 @@ This source code is licensed under the MIT license found in the
 LICENSE file in the root directory of this source tree.
 */
 #include <algorithm>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <glib.h>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <libavutil/mathematics.h>
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
@@ -20,57 +23,10 @@ using namespace std;
 int DEFAULT_FAN_VALUE = 5;
 int MIN_HASH_TIME_DELTA = 0;
 int MAX_HASH_TIME_DELTA = 200;
-int FINGERPRINT_REDUCTION = 10;
 int PEAK_NEIGHBORHOOD_SIZE = 20;
 int DEFAULT_WINDOW_SIZE = 4096;
 float DEFAULT_OVERLAP_RATIO = 0.5;
 
-std::vector<std::vector<float>>
-stride_windows (const std::vector<float> &data, size_t blocksize,
-                size_t overlap)
-{
-  // https://stackoverflow.com/questions/21344296/striding-windows/21345055
-  std::vector<std::vector<float>> res;
-  size_t minlen = (data.size () - overlap) / (blocksize - overlap);
-  auto start = data.begin ();
-  for (size_t i = 0; i < blocksize; ++i)
-    {
-      res.emplace_back (std::vector<float> ());
-      std::vector<float> &block = res.back ();
-      auto it = start++;
-      for (size_t j = 0; j < minlen; ++j)
-        {
-          block.push_back (*it);
-          std::advance (it, (blocksize - overlap));
-        }
-    }
-  return res;
-}
-
-int
-detrend (std::vector<std::vector<float>> &data)
-{
-  size_t nocols = data[0].size ();
-  size_t norows = data.size ();
-  float mean = 0;
-  for (size_t i = 0; i < nocols; ++i)
-    {
-      for (size_t j = 0; j < norows; ++j)
-        {
-          mean = mean + data[j][i];
-        }
-    }
-  mean = mean / (norows * nocols);
-  for (size_t i = 0; i < nocols; ++i)
-    {
-      for (size_t j = 0; j < norows; ++j)
-        {
-          data[j][i] = data[j][i] - mean;
-        }
-    }
-  return 0;
-}
-
 std::vector<float>
 create_window (int wsize)
 {
@@ -84,35 +40,35 @@ create_window (int wsize)
   return res;
 }
 
-void
-apply_window (std::vector<float> &hann_window,
-              std::vector<std::vector<float>> &data)
+/* call fn (freq1, freq2, time1, t_delta) for each pair of peaks that
+ * makes a hash, v_in sorted by time then frequency */
+template <typename F>
+static void
+for_each_peak_pair (const vector<pair<int, int>> &v_in, F fn)
 {
-  size_t nocols = data[0].size ();
-  size_t norows = data.size ();
-  for (size_t i = 0; i < nocols; ++i)
+  for (int i = 0; i < v_in.size (); i++)
     {
-      for (size_t j = 0; j < norows; ++j)
+      for (int j = 1; j < DEFAULT_FAN_VALUE; j++)
         {
-          data[j][i] = data[j][i] * hann_window[j];
+          if ((i + j) < v_in.size ())
+            {
+              int freq1 = v_in[i].first;
+              int freq2 = v_in[i + j].first;
+              int time1 = v_in[i].second;
+              int time2 = v_in[i + j].second;
+              int t_delta = time2 - time1;
+              if ((t_delta >= MIN_HASH_TIME_DELTA)
+                  && (t_delta <= MAX_HASH_TIME_DELTA))
+                {
+                  fn (freq1, freq2, time1, t_delta);
+                }
+            }
         }
     }
 }
 
-std::string
-get_sha1 (const std::string &p_arg)
-{
-  auto sum = g_checksum_new (G_CHECKSUM_SHA1);
-  g_checksum_update (sum, (guchar *)p_arg.c_str (), p_arg.size ());
-  auto digest = g_checksum_get_string (sum);
-  string str = digest;
-  g_checksum_free (sum);
-  return str;
-}
-
-void
-generate_hashes (vector<pair<int, int>> &v_in, fingerprint_callback callback,
-                 fingerprint_arg arg)
+static void
+sort_peaks (vector<pair<int, int>> &v_in)
 {
   // sorting
   // https://stackoverflow.com/questions/279854/how-do-i-sort-a-vector-of-pairs-based-on-the-second-element-of-the-pair
@@ -121,68 +77,178 @@ generate_hashes (vector<pair<int, int>> &v_in, fingerprint_callback callback,
       return left.first < right.first;
     return left.second < right.second;
   });
+}
 
-  for (int i = 0; i < v_in.size (); i++)
+void
+generate_hashes (vector<pair<int, int>> &v_in, fingerprint_callback callback,
+                 fingerprint_arg arg)
+{
+  sort_peaks (v_in);
+
+  for_each_peak_pair (v_in, [&] (int freq1, int freq2, int time1,
+                                 int t_delta) {
+    callback (FINGERPRINT_LANDMARK (freq1, freq2, t_delta), time1, arg);
+  });
+}
+
+/* every local maximum of the spectrogram, whatever its amplitude */
+struct fingerprint_peaks_s
+{
+  /* (freq, time) by decreasing amplitude */
+  vector<pair<int, int>> peaks;
+  /* their amplitudes, decreasing */
+  vector<float> amps;
+};
+
+/* the peaks louder than amp_min, sorted as generate_hashes wants them */
+static vector<pair<int, int>>
+peaks_above (const fingerprint_peaks *p, float amp_min)
+{
+  auto end = std::partition_point (p->amps.begin (), p->amps.end (),
+                                   [amp_min] (float amp) {
+                                     return amp > amp_min;
+                                   });
+  vector<pair<int, int>> v_in (p->peaks.begin (),
+                               p->peaks.begin () + (end - p->amps.begin ()));
+  sort_peaks (v_in);
+  return v_in;
+}
+
+/* the running maximum of the n values from src, stride apart, over the
+ * k values before and after each, into dst at the same stride, by van
+ * Herk/Gil-Werman: the line, with k lowest values on each end, is cut
+ * into blocks of 2k + 1, g is the maximum from the start of each block
+ * and h up to its end, and any window spans at most two blocks; g and h
+ * hold n + 2k values */
+static void
+line_max (const float *src, float *dst, ptrdiff_t stride, int n, int k,
+          float *g, float *h)
+{
+  const float lowest = -std::numeric_limits<float>::infinity ();
+  int w = 2 * k + 1, m = n + 2 * k, i;
+  float x;
+
+  for (i = 0; i < m; ++i)
     {
-      for (int j = 1; j < DEFAULT_FAN_VALUE; j++)
+      x = (i >= k && i < k + n) ? src[(i - k) * stride] : lowest;
+      g[i] = (i % w == 0) ? x : std::max (g[i - 1], x);
+    }
+  for (i = m - 1; i >= 0; --i)
+    {
+      x = (i >= k && i < k + n) ? src[(i - k) * stride] : lowest;
+      h[i] = (i % w == w - 1 || i == m - 1) ? x : std::max (h[i + 1], x);
+    }
+  for (i = 0; i < n; ++i)
+    {
+      dst[i * stride] = std::max (h[i], g[i + 2 * k]);
+    }
+}
+
+/* line_max along every diagonal of m going down and right (d = 1) or
+ * down and left (d = -1), in place */
+static void
+diagonal_max (cv::Mat &m, int d, int k, float *g, float *h)
+{
+  float *base = m.ptr<float> (0);
+  ptrdiff_t stride = m.cols + d;
+  int r, c, n;
+
+  /* from each value of the first row */
+  for (c = 0; c < m.cols; ++c)
+    {
+      n = std::min (m.rows, d > 0 ? m.cols - c : c + 1);
+      line_max (base + c, base + c, stride, n, k, g, h);
+    }
+  /* and from the side the diagonals start on */
+  c = d > 0 ? 0 : m.cols - 1;
+  for (r = 1; r < m.rows; ++r)
+    {
+      n = std::min (m.rows - r, m.cols);
+      line_max (base + r * m.cols + c, base + r * m.cols + c, stride, n, k,
+                g, h);
+    }
+}
+
+/* the maximum over |di| + |dj| <= PEAK_NEIGHBORHOOD_SIZE around each value,
+ * what cv::dilate gives with the diamond kernel but in a few operations a
+ * value instead of one per kernel element.  The diamond of radius 2k + 1
+ * is the sum of the two diagonal segments of half length k and a 3x3
+ * cross, radius 2k + 2 takes one more cross.  Padding by the radius keeps
+ * every intermediate maximum, so the edges are exact too. */
+static cv::Mat
+max_filter (const cv::Mat &data)
+{
+  int radius = PEAK_NEIGHBORHOOD_SIZE;
+  int k = std::max (radius - 1, 0) / 2;
+  int crosses = radius - 2 * k;
+  cv::Mat m;
+
+  cv::copyMakeBorder (data, m, radius, radius, radius, radius,
+                      cv::BORDER_CONSTANT | cv::BORDER_ISOLATED,
+                      cv::Scalar (-std::numeric_limits<float>::infinity ()));
+  if (k > 0)
+    {
+      vector<float> g (std::max (m.rows, m.cols) + 2 * k);
+      vector<float> h (g.size ());
+
+      diagonal_max (m, 1, k, g.data (), h.data ());
+      diagonal_max (m, -1, k, g.data (), h.data ());
+    }
+  if (crosses > 0)
+    {
+      cv::dilate (m, m,
+                  cv::getStructuringElement (cv::MORPH_CROSS, cv::Size (3, 3),
+                                             cv::Point (-1, -1)),
+                  cv::Point (-1, -1), crosses);
+    }
+
+  return m (cv::Rect (radius, radius, data.cols, data.rows));
+}
+
+/* whether the zero at i, j is in a background of zeros that the diamond
+ * neighbourhood does not leave, such a flat spot is no peak */
+static bool
+zero_background (const cv::Mat &data, int i, int j)
+{
+  int radius = PEAK_NEIGHBORHOOD_SIZE;
+  int di, dj, span;
+
+  for (di = std::max (-radius, -i); di <= radius && i + di < data.rows; ++di)
+    {
+      span = radius - std::abs (di);
+      for (dj = std::max (-span, -j); dj <= span && j + dj < data.cols; ++dj)
         {
-          if ((i + j) < v_in.size ())
+          if (data.at<float> (i + di, j + dj) != 0)
             {
-              int freq1 = v_in[i].first;
-              int freq2 = v_in[i + j].first;
-              int time1 = v_in[i].second;
-              int time2 = v_in[i + j].second;
-              int t_delta = time2 - time1;
-              if ((t_delta >= MIN_HASH_TIME_DELTA)
-                  && (t_delta <= MAX_HASH_TIME_DELTA))
-                {
-                  char buffer[100];
-                  snprintf (buffer, sizeof (buffer), "%d|%d|%d", freq1, freq2,
-                            t_delta);
-                  std::string to_be_hashed = buffer;
-                  std::string hash_result
-                      = get_sha1 (to_be_hashed)
-                            .erase (FINGERPRINT_REDUCTION, 40);
-                  callback (hash_result.c_str (), time1, arg);
-                }
+              return false;
             }
         }
     }
+
+  return true;
 }
 
+/* the local maxima of data louder than amp_min, as (row, column) */
 vector<pair<int, int>>
-get_2D_peaks (cv::Mat data, int amp_min)
+get_2D_peaks (cv::Mat data, float amp_min, vector<float> *amps = NULL)
 {
-  /* generate binary structure and apply maximum filter*/
-  cv::Mat tmpkernel = cv::getStructuringElement (
-      cv::MORPH_CROSS, cv::Size (3, 3), cv::Point (-1, -1));
-  cv::Mat kernel
-      = cv::Mat (PEAK_NEIGHBORHOOD_SIZE * 2 + 1,
-                 PEAK_NEIGHBORHOOD_SIZE * 2 + 1, CV_8U, uint8_t (0));
-  kernel.at<uint8_t> (PEAK_NEIGHBORHOOD_SIZE, PEAK_NEIGHBORHOOD_SIZE)
-      = uint8_t (1);
-  cv::dilate (kernel, kernel, tmpkernel, cv::Point (-1, -1),
-              PEAK_NEIGHBORHOOD_SIZE, 1, 1);
-  cv::Mat d1;
-  cv::dilate (data, d1,
-              kernel); /* d1 now contain m1 with max filter applied */
-  /* generate eroded background */
-  cv::Mat background = (data == 0); // 255 if element == 0 , 0 otherwise
-  cv::Mat local_max = (data == d1); // 255 if true, 0 otherwise
-  cv::Mat eroded_background;
-  cv::erode (background, eroded_background, kernel);
-  cv::Mat detected_peaks = local_max - eroded_background;
-  /* now detected peaks.size == m1.size .. iterate through m1. get amp where
-   * peak == 255 (true), get indices i,j as well.*/
+  cv::Mat d1 = max_filter (data);
   vector<pair<int, int>> freq_time_idx_pairs;
+
   for (int i = 0; i < data.rows; ++i)
     {
+      const float *row = data.ptr<float> (i);
+      const float *max = d1.ptr<float> (i);
       for (int j = 0; j < data.cols; ++j)
         {
-          if ((detected_peaks.at<uint8_t> (i, j) == 255)
-              && (data.at<float> (i, j) > amp_min))
+          if (row[j] > amp_min && row[j] == max[j]
+              && (row[j] != 0 || !zero_background (data, i, j)))
             {
               freq_time_idx_pairs.emplace_back (i, j);
+              if (amps)
+                {
+                  amps->push_back (row[j]);
+                }
             }
         }
     }
@@ -190,122 +256,299 @@ get_2D_peaks (cv::Mat data, int amp_min)
   return freq_time_idx_pairs;
 }
 
-void
-max_filter (std::vector<std::vector<float>> &data, int amp_min)
+/* the number of frequencies of a onesided spectrum, see mlab.py */
+static int
+spectrum_size ()
 {
-  // https://gist.github.com/otmb/014107e7b6c6d6a79f0ac1ccc456580a
-  cv::Mat m1 (data.size (), data.at (0).size (), CV_32F);
-  for (int i = 0; i < m1.rows; ++i)
-    for (int j = 0; j < m1.cols; ++j)
-      m1.at<float> (i, j) = data.at (i).at (j);
+  if (DEFAULT_WINDOW_SIZE % 2 == 0)
+    {
+      return int (std::floor (DEFAULT_WINDOW_SIZE / 2)) + 1;
+    }
+  return int (std::floor ((DEFAULT_WINDOW_SIZE + 1) / 2));
+}
 
-  /* generate binary structure and apply maximum filter*/
-  cv::Mat tmpkernel = cv::getStructuringElement (
-      cv::MORPH_CROSS, cv::Size (3, 3), cv::Point (-1, -1));
-  cv::Mat kernel
-      = cv::Mat (PEAK_NEIGHBORHOOD_SIZE * 2 + 1,
-                 PEAK_NEIGHBORHOOD_SIZE * 2 + 1, CV_8U, uint8_t (0));
-  kernel.at<uint8_t> (PEAK_NEIGHBORHOOD_SIZE, PEAK_NEIGHBORHOOD_SIZE)
-      = uint8_t (1);
-  cv::dilate (kernel, kernel, tmpkernel, cv::Point (-1, -1),
-              PEAK_NEIGHBORHOOD_SIZE, 1, 1);
-  cv::Mat d1;
-  cv::dilate (m1, d1, kernel);
-  /* d1 now contain m1 with max filter applied */
-  /* generate eroded background */
-  cv::Mat background = (m1 == 0);
-  cv::Mat local_max = (m1 == d1);
-  cv::Mat eroded_background;
-  cv::erode (background, eroded_background, kernel);
-  cv::Mat detected_peaks = local_max - eroded_background;
-  vector<pair<int, int>> freq_time_idx_pairs;
-  for (int i = 0; i < m1.rows; ++i)
+/* spectrogram columns searched for peaks at a time, with
+ * PEAK_NEIGHBORHOOD_SIZE more columns of context on each side */
+#define FINGERPRINT_STREAM_COLUMNS 512
+/* windows transformed together */
+#define FINGERPRINT_STREAM_FRAMES 64
+
+/* Samples are gathered until FINGERPRINT_STREAM_FRAMES windows are
+ * complete, the windows are copied as contiguous rows, windowed and
+ * transformed in one pass, and the rows of log power are appended to a
+ * band of spectrogram columns.  When the band is full its inner columns
+ * are searched for peaks and dropped.  The band keeps the columns the
+ * maximum filter of its neighbours needs, so the peaks are those of the
+ * whole spectrogram while memory stays the same for any length of audio. */
+struct fingerprint_stream_s
+{
+  int hop;
+  /* the quietest peak kept */
+  float amp_min;
+  /* the hann window repeated on each row of frames */
+  cv::Mat hann;
+  /* the power scale of each frequency, the onesided doubling and
+   * 1 / (fs * sum (hann ^ 2)) */
+  cv::Mat scale;
+
+  /* the samples of the next windows */
+  vector<float> samples;
+  int filled;
+
+  cv::Mat frames;
+  cv::Mat spectrum;
+  cv::Mat power;
+
+  /* a row per window and a column per frequency, transposed for the
+   * search */
+  cv::Mat band;
+  /* windows used, the first one not searched yet and the time of the
+   * first one */
+  int columns;
+  int left;
+  int base;
+
+  vector<pair<int, int>> peaks;
+  vector<float> amps;
+
+  /* when set, each band searched is kept there, for test_fingerprint_peaks */
+  vector<cv::Mat> *searched;
+};
+
+fingerprint_stream *
+fingerprint_stream_new (float fs, float amp_min)
+{
+  auto *s = new fingerprint_stream_s;
+  vector<float> hann = create_window (DEFAULT_WINDOW_SIZE);
+  float sum = 0.0;
+  int n = spectrum_size ();
+
+  s->hop = DEFAULT_WINDOW_SIZE
+           - int (DEFAULT_WINDOW_SIZE * DEFAULT_OVERLAP_RATIO);
+  s->amp_min = amp_min;
+  cv::repeat (cv::Mat (hann).reshape (1, 1), FINGERPRINT_STREAM_FRAMES, 1,
+              s->hann);
+  for (float w : hann)
     {
-      for (int j = 0; j < m1.cols; ++j)
+      sum = sum + (w * w);
+    }
+  cv::Mat scale (1, n, CV_32F, cv::Scalar (2.0 / fs / sum));
+  scale.at<float> (0, 0) = 1.0 / fs / sum;
+  scale.at<float> (0, n - 1) = 1.0 / fs / sum;
+  cv::repeat (scale, FINGERPRINT_STREAM_FRAMES, 1, s->scale);
+
+  s->samples.resize (DEFAULT_WINDOW_SIZE
+                     + (FINGERPRINT_STREAM_FRAMES - 1) * s->hop);
+  s->filled = 0;
+
+  s->frames = cv::Mat (FINGERPRINT_STREAM_FRAMES, DEFAULT_WINDOW_SIZE, CV_32F);
+  s->band = cv::Mat (FINGERPRINT_STREAM_COLUMNS + PEAK_NEIGHBORHOOD_SIZE * 2,
+                     n, CV_32F);
+  s->columns = 0;
+  s->left = 0;
+  s->base = 0;
+  s->searched = NULL;
+
+  return s;
+}
+
+/* search the band for peaks in its columns from left up to end, the last
+ * ones being the end of the audio or else keeping enough columns to go on
+ * with the next band */
+static void
+stream_search (fingerprint_stream *s, bool last)
+{
+  int end = last ? s->columns : s->columns - PEAK_NEIGHBORHOOD_SIZE;
+  int keep = PEAK_NEIGHBORHOOD_SIZE * 2;
+
+  if (end > s->left)
+    {
+      /* a copy, the filters would read the stale columns past an ROI */
+      cv::Mat spec;
+      vector<float> amps;
+
+      cv::transpose (s->band.rowRange (0, s->columns), spec);
+      if (s->searched)
+        {
+          s->searched->push_back (spec);
+        }
+      vector<pair<int, int>> found = get_2D_peaks (spec, s->amp_min, &amps);
+
+      for (size_t i = 0; i < found.size (); ++i)
         {
-          if ((detected_peaks.at<uint8_t> (i, j) == 255)
-              && (m1.at<float> (i, j) > amp_min))
+          if (found[i].second >= s->left && found[i].second < end)
             {
-              freq_time_idx_pairs.push_back (std::make_pair (i, j));
+              s->peaks.emplace_back (found[i].first,
+                                     found[i].second + s->base);
+              s->amps.push_back (amps[i]);
             }
         }
     }
-}
 
-void
-fingerprint (float *data, int data_size, float fs, int amp_min,
-             fingerprint_callback callback, fingerprint_arg arg)
-{
-  std::vector<float> vec (&data[0], data + data_size);
-  // see mlab.py on how to decide number of frequencies
-  int max_freq = 0; // onesided
-  if (DEFAULT_WINDOW_SIZE % 2 == 0)
+  if (!last)
     {
-      max_freq = int (std::floor (DEFAULT_WINDOW_SIZE / 2)) + 1;
+      cv::Mat tail = s->band.rowRange (s->columns - keep, s->columns).clone ();
+      tail.copyTo (s->band.rowRange (0, keep));
+      s->base += s->columns - keep;
+      s->columns = keep;
+      s->left = PEAK_NEIGHBORHOOD_SIZE;
     }
-  else
+}
+
+/* transform the first count windows of the samples and append their
+ * columns to the band */
+static void
+stream_frames (fingerprint_stream *s, int count)
+{
+  cv::Rect rows (0, 0, spectrum_size (), count);
+  int k;
+
+  for (k = 0; k < count; ++k)
     {
-      max_freq = int (std::floor ((DEFAULT_WINDOW_SIZE + 1) / 2));
+      memcpy (s->frames.ptr<float> (k), s->samples.data () + k * s->hop,
+              DEFAULT_WINDOW_SIZE * sizeof (float));
     }
 
-  std::vector<std::vector<float>> blocks = stride_windows (
-      vec, DEFAULT_WINDOW_SIZE, DEFAULT_WINDOW_SIZE * DEFAULT_OVERLAP_RATIO);
-  std::vector<float> hann_window = create_window (DEFAULT_WINDOW_SIZE);
-  apply_window (hann_window, blocks);
-
-  cv::Mat dst (blocks[0].size (), blocks.size (), CV_32F);
-  for (int i = 0; i < dst.rows; ++i)
-    for (int j = 0; j < dst.cols; ++j)
-      {
-        dst.at<float> (i, j) = blocks[j][i];
-      }
-  cv::dft (dst, dst, cv::DftFlags::DFT_COMPLEX_OUTPUT + cv::DftFlags::DFT_ROWS,
-           0);
-  cv::mulSpectrums (dst, dst, dst, 0, true);
-
-  cv::Mat dst2 (max_freq, blocks.at (0).size (), CV_32F);
-  for (int i = 0; i < max_freq; ++i)
-    for (int j = 0; j < dst2.cols; ++j)
-      {
-        dst2.at<float> (i, j) = dst.ptr<float> (j)[2 * i];
-      }
-
-  for (int i = 1; i < dst2.rows - 1; ++i)
-    for (int j = 0; j < dst2.cols; ++j)
-      dst2.at<float> (i, j) = dst2.at<float> (i, j) * 2;
-
-  dst2 = dst2 * (1.0 / fs);
-  float sum = 0.0;
-  float tmp = 0.0;
-  for (unsigned int i = 0; i < hann_window.size (); i++)
+  cv::Mat frames = s->frames.rowRange (0, count);
+  cv::multiply (frames, s->hann.rowRange (0, count), frames);
+  cv::dft (frames, s->spectrum,
+           cv::DftFlags::DFT_COMPLEX_OUTPUT + cv::DftFlags::DFT_ROWS, 0);
+  cv::mulSpectrums (s->spectrum, s->spectrum, s->spectrum, 0, true);
+  cv::extractChannel (s->spectrum, s->power, 0);
+
+  cv::Mat power = s->power (rows);
+  cv::multiply (power, s->scale (rows), power);
+  // see https://github.com/worldveil/dejavu/issues/118
+  cv::max (power, 0.00000001, power);
+  cv::log (power, power);
+  power *= 10 / std::log (10.0);
+
+  for (k = 0; k < count; ++k)
     {
-      if (hann_window[i] < 0)
-        tmp = hann_window[i] * -1;
-      else
-        tmp = hann_window[i];
-      sum = sum + (tmp * tmp);
+      power.row (k).copyTo (s->band.row (s->columns));
+      if (++s->columns == s->band.rows)
+        {
+          stream_search (s, false);
+        }
     }
-  dst2 = dst2 * (1.0 / sum);
-  // see https://github.com/worldveil/dejavu/issues/118
-  float threshold = 0.00000001;
-  for (int i = 0; i < dst2.rows; ++i)
+}
+
+template <typename T>
+static void
+stream_push (fingerprint_stream *s, const T *data, int count)
+{
+  int size = s->samples.size ();
+  int n, windows;
+
+  while (count > 0)
     {
-      for (int j = 0; j < dst2.cols; ++j)
+      n = std::min (count, size - s->filled);
+      std::copy (data, data + n, s->samples.begin () + s->filled);
+      s->filled += n;
+      data += n;
+      count -= n;
+
+      if (s->filled == size)
         {
-          if ((dst2.at<float> (i, j)) < threshold)
-            {
-              dst2.at<float> (i, j) = threshold;
-            }
-          dst2.at<float> (i, j) = 10 * log10 (dst2.at<float> (i, j));
+          stream_frames (s, FINGERPRINT_STREAM_FRAMES);
+          /* the overlap of the last window starts the next one */
+          windows = FINGERPRINT_STREAM_FRAMES * s->hop;
+          std::copy (s->samples.begin () + windows, s->samples.end (),
+                     s->samples.begin ());
+          s->filled -= windows;
         }
     }
+}
+
+void
+fingerprint_stream_push (fingerprint_stream *s, const short *samples,
+                         int count)
+{
+  stream_push (s, samples, count);
+}
+
+fingerprint_peaks *
+fingerprint_stream_finish (fingerprint_stream *s)
+{
+  auto *p = new fingerprint_peaks_s;
+  vector<size_t> order;
+
+  if (s->filled >= DEFAULT_WINDOW_SIZE)
+    {
+      stream_frames (s, (s->filled - DEFAULT_WINDOW_SIZE) / s->hop + 1);
+    }
+  stream_search (s, true);
+
+  order.resize (s->peaks.size ());
+  for (size_t i = 0; i < order.size (); ++i)
+    {
+      order[i] = i;
+    }
+  std::sort (order.begin (), order.end (), [s] (size_t a, size_t b) {
+    return s->amps[a] > s->amps[b];
+  });
+
+  p->peaks.reserve (order.size ());
+  p->amps.reserve (order.size ());
+  for (size_t i : order)
+    {
+      p->peaks.push_back (s->peaks[i]);
+      p->amps.push_back (s->amps[i]);
+    }
+
+  delete s;
+
+  return p;
+}
+
+fingerprint_peaks *
+fingerprint_peaks_new (float *data, int data_size, float fs, float amp_min)
+{
+  fingerprint_stream *s = fingerprint_stream_new (fs, amp_min);
+
+  stream_push (s, data, data_size);
+
+  return fingerprint_stream_finish (s);
+}
+
+void
+fingerprint_peaks_free (fingerprint_peaks *p)
+{
+  delete p;
+}
+
+int
+fingerprint_peaks_hash_count (const fingerprint_peaks *p, float amp_min)
+{
+  int count = 0;
+
+  for_each_peak_pair (peaks_above (p, amp_min),
+                      [&count] (int, int, int, int) { ++count; });
+
+  return count;
+}
+
+void
+fingerprint_peaks_hashes (const fingerprint_peaks *p, float amp_min,
+                          fingerprint_callback callback, fingerprint_arg arg)
+{
+  vector<pair<int, int>> v_in = peaks_above (p, amp_min);
 
-  vector<pair<int, int>> v_in = get_2D_peaks (dst2, amp_min);
   generate_hashes (v_in, callback, arg);
 }
 
+void
+fingerprint (float *data, int data_size, float fs, int amp_min,
+             fingerprint_callback callback, fingerprint_arg arg)
+{
+  fingerprint_peaks *p = fingerprint_peaks_new (data, data_size, fs, amp_min);
+
+  fingerprint_peaks_hashes (p, amp_min, callback, arg);
+  fingerprint_peaks_free (p);
+}
+
 static int
-test_callback (const char *hash, int offset, void *ptr)
+test_callback (uint32_t hash, int offset, void *ptr)
 {
   auto *buf = (ostringstream *)ptr;
   if (buf->str () != "[")
@@ -317,8 +560,10 @@ test_callback (const char *hash, int offset, void *ptr)
   return 0;
 }
 
-int
-test_fingerprint (const char *file)
+/* the samples of the first size of file, as 22050 Hz mono, into data;
+ * return their count */
+static int
+test_samples (const char *file, float *data, int size)
 {
   std::string cmd = "ffmpeg -hide_banner -loglevel panic -i \"";
   cmd.append (file);
@@ -330,10 +575,9 @@ test_fingerprint (const char *file)
   // https://stackoverflow.com/questions/49161854/reading-raw-audio-file
   std::fstream f_in;
   short speech;
-  float data[2000000];
   f_in.open ("/tmp/raw_data", std::ios::in | std::ios::binary);
   int i = 0;
-  while (i < 2000000)
+  while (i < size)
     {
       f_in.read ((char *)&speech, 2);
       if (!f_in.good ())
@@ -345,6 +589,15 @@ test_fingerprint (const char *file)
     }
   f_in.close ();
 
+  return i;
+}
+
+int
+test_fingerprint (const char *file)
+{
+  static float data[2000000];
+  int i = test_samples (file, data, 2000000);
+
   std::ofstream s ("/tmp/test1-test_fingerprint.dat");
   s << "[";
   fingerprint (data, i, 22050, 20, test_callback, &s);
@@ -353,3 +606,127 @@ test_fingerprint (const char *file)
 
   return 0;
 }
+
+/* the local maxima as get_2D_peaks found them before max_filter, with
+ * cv::dilate and cv::erode by the diamond kernel */
+static vector<pair<int, int>>
+get_2D_peaks_kernel (const cv::Mat &data, float amp_min)
+{
+  cv::Mat tmpkernel = cv::getStructuringElement (
+      cv::MORPH_CROSS, cv::Size (3, 3), cv::Point (-1, -1));
+  cv::Mat kernel
+      = cv::Mat (PEAK_NEIGHBORHOOD_SIZE * 2 + 1,
+                 PEAK_NEIGHBORHOOD_SIZE * 2 + 1, CV_8U, uint8_t (0));
+  kernel.at<uint8_t> (PEAK_NEIGHBORHOOD_SIZE, PEAK_NEIGHBORHOOD_SIZE)
+      = uint8_t (1);
+  cv::dilate (kernel, kernel, tmpkernel, cv::Point (-1, -1),
+              PEAK_NEIGHBORHOOD_SIZE, 1, 1);
+  cv::Mat d1;
+  cv::dilate (data, d1, kernel);
+  cv::Mat background = (data == 0);
+  cv::Mat local_max = (data == d1);
+  cv::Mat eroded_background;
+  cv::erode (background, eroded_background, kernel);
+  cv::Mat detected_peaks = local_max - eroded_background;
+  vector<pair<int, int>> freq_time_idx_pairs;
+
+  for (int i = 0; i < data.rows; ++i)
+    {
+      for (int j = 0; j < data.cols; ++j)
+        {
+          if (detected_peaks.at<uint8_t> (i, j) == 255
+              && data.at<float> (i, j) > amp_min)
+            {
+              freq_time_idx_pairs.emplace_back (i, j);
+            }
+        }
+    }
+
+  return freq_time_idx_pairs;
+}
+
+/* whether get_2D_peaks and the kernel version find the same peaks of m,
+ * their times added to filter_us and kernel_us */
+static bool
+test_peaks_same (const cv::Mat &m, float amp_min, gint64 *filter_us,
+                 gint64 *kernel_us)
+{
+  gint64 start = g_get_monotonic_time ();
+  vector<pair<int, int>> a = get_2D_peaks (m, amp_min);
+  *filter_us += g_get_monotonic_time () - start;
+
+  start = g_get_monotonic_time ();
+  vector<pair<int, int>> b = get_2D_peaks_kernel (m, amp_min);
+  *kernel_us += g_get_monotonic_time () - start;
+
+  return a == b;
+}
+
+int
+test_fingerprint_peaks (const char *file, int count)
+{
+  const float lowest = std::numeric_limits<float>::lowest ();
+  cv::RNG rng (1);
+  gint64 filter_us = 0, kernel_us = 0;
+  int i, diff = 0;
+
+  /* random values, small integers with many ties and zeros, and sparse
+   * ones on a zero background, of any size up to a few bands high */
+  for (i = 0; i < count; ++i)
+    {
+      cv::Mat m (rng.uniform (1, 160), rng.uniform (1, 160), CV_32F);
+      switch (i % 3)
+        {
+        case 0:
+          rng.fill (m, cv::RNG::UNIFORM, -80.0, 40.0);
+          break;
+        case 1:
+          rng.fill (m, cv::RNG::UNIFORM, 0.0, 4.0);
+          m.convertTo (m, CV_32S);
+          m.convertTo (m, CV_32F);
+          break;
+        default:
+          m.setTo (0);
+          for (int k = rng.uniform (0, 8); k > 0; --k)
+            {
+              m.at<float> (rng.uniform (0, m.rows), rng.uniform (0, m.cols))
+                  = rng.uniform (-5.0f, 5.0f);
+            }
+          break;
+        }
+      if (!test_peaks_same (m, lowest, &filter_us, &kernel_us))
+        {
+          ++diff;
+        }
+    }
+  printf ("peaks x %d random: max filter %.3fs, kernel %.3fs, %d differ\n",
+          count, filter_us / 1e6, kernel_us / 1e6, diff);
+
+  /* and the bands the stream searches in the spectrogram of file */
+  if (file)
+    {
+      static float data[2000000];
+      vector<cv::Mat> bands;
+      fingerprint_stream *s = fingerprint_stream_new (22050, 0);
+      int n = test_samples (file, data, 2000000), bad = 0;
+
+      s->searched = &bands;
+      stream_push (s, data, n);
+      fingerprint_peaks_free (fingerprint_stream_finish (s));
+
+      filter_us = kernel_us = 0;
+      for (const cv::Mat &band : bands)
+        {
+          if (!test_peaks_same (band, lowest, &filter_us, &kernel_us))
+            {
+              ++bad;
+            }
+        }
+      printf ("peaks x %zu bands of %s: max filter %.3fs, kernel %.3fs, %d "
+              "differ\n",
+              bands.size (), file, filter_us / 1e6, kernel_us / 1e6, bad);
+      diff += bad;
+    }
+
+  return diff;
+}
@@ -1,18 +1,63 @@
 #ifndef FDUPVES_FINGERPRINT_H
 #define FDUPVES_FINGERPRINT_H
 
+#include <stdint.h>
+
+/* a landmark, two peak frequencies and the windows between them, packed
+ * in 12, 12 and 8 bits */
+#define FINGERPRINT_FREQ_BITS 12
+#define FINGERPRINT_DELTA_BITS 8
+#define FINGERPRINT_LANDMARK(freq1, freq2, t_delta)                          \
+  ((((uint32_t)(freq1) & ((1u << FINGERPRINT_FREQ_BITS) - 1))                 \
+    << (FINGERPRINT_FREQ_BITS + FINGERPRINT_DELTA_BITS))                      \
+   | (((uint32_t)(freq2) & ((1u << FINGERPRINT_FREQ_BITS) - 1))               \
+      << FINGERPRINT_DELTA_BITS)                                              \
+   | ((uint32_t)(t_delta) & ((1u << FINGERPRINT_DELTA_BITS) - 1)))
+
 #ifdef __cplusplus
 extern "C"
 {
 #endif
-  typedef int (*fingerprint_callback) (const char *, int, void *);
+  typedef int (*fingerprint_callback) (uint32_t landmark, int offset,
+                                       void *);
   typedef void *fingerprint_arg;
 
   void fingerprint (float *data, int data_size, float fs, int amp_min,
                     fingerprint_callback cb, fingerprint_arg arg);
 
+  /* the spectrogram peaks of data louder than amp_min, computed once so
+   * hashes can be taken at any higher amplitude threshold */
+  typedef struct fingerprint_peaks_s fingerprint_peaks;
+
+  fingerprint_peaks *fingerprint_peaks_new (float *data, int data_size,
+                                            float fs, float amp_min);
+
+  void fingerprint_peaks_free (fingerprint_peaks *);
+
+  /* the same peaks from samples pushed a chunk at a time, in a memory that
+   * does not grow with the length of the audio */
+  typedef struct fingerprint_stream_s fingerprint_stream;
+
+  fingerprint_stream *fingerprint_stream_new (float fs, float amp_min);
+
+  void fingerprint_stream_push (fingerprint_stream *, const short *samples,
+                                int count);
+
+  /* the peaks of all the samples pushed, the stream is freed */
+  fingerprint_peaks *fingerprint_stream_finish (fingerprint_stream *);
+
+  int fingerprint_peaks_hash_count (const fingerprint_peaks *, float amp_min);
+
+  void fingerprint_peaks_hashes (const fingerprint_peaks *, float amp_min,
+                                 fingerprint_callback cb, fingerprint_arg arg);
+
   int test_fingerprint (const char *);
 
+  /* compare the peaks of the max filter with those of the 41x41 kernel
+   * dilate it replaced, on count random matrices and, when file is not
+   * NULL, on its spectrogram; return the ones that differ */
+  int test_fingerprint_peaks (const char *file, int count);
+
 #ifdef __cplusplus
 }
 #endif
@@ -27,6 +27,7 @@
 #include "audio.h"
 #include "../fingerprint/fingerprint.h"
 #include "util.h"
+#include "cache.h"
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
@@ -35,58 +36,147 @@
 #include <libavutil/channel_layout.h>
 
 #include <glib.h>
+#include <string.h>
 
-audio_info *
-audio_get_info (const char *file)
+/* the quietest peak audio_fingerprint can hash */
+#define FDUPVES_AUDIO_AMP_MIN 5
+
+/* whether the container headers gave what decoding and probing the
+ * stream need, so no packets have to be read for them */
+static gboolean
+audio_stream_known (AVFormatContext *fmt_ctx, int s)
+{
+  AVStream *stream = fmt_ctx->streams[s];
+  AVCodecParameters *par = stream->codecpar;
+
+#if LIBSWRESAMPLE_VERSION_INT < AV_VERSION_INT(4, 0, 100)
+  if (par->channels <= 0)
+#else
+  if (par->ch_layout.nb_channels <= 0)
+#endif
+    {
+      return FALSE;
+    }
+
+  return par->codec_id != AV_CODEC_ID_NONE && par->sample_rate > 0
+         && (stream->duration != AV_NOPTS_VALUE
+             || fmt_ctx->duration != AV_NOPTS_VALUE);
+}
+
+/* open file and find its best audio stream, returns its index or -1;
+ * avformat_find_stream_info, which decodes to fill in the streams, only
+ * runs when the headers fall short */
+static int
+audio_open (const char *file, AVFormatContext **pfmt_ctx)
 {
-  audio_info *info;
   AVFormatContext *fmt_ctx = NULL;
-  AVStream *stream = NULL;
-  int s, ret;
+  int s;
 
-  ret = avformat_open_input (&fmt_ctx, file, NULL, NULL);
-  if (ret != 0)
+  if (avformat_open_input (&fmt_ctx, file, NULL, NULL) != 0)
     {
       g_warning (_ ("could not open: %s"), file);
-      return NULL;
+      return -1;
     }
 
-  if (avformat_find_stream_info (fmt_ctx, NULL) < 0)
+  s = av_find_best_stream (fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+  if (s < 0 || !audio_stream_known (fmt_ctx, s))
     {
-      g_warning (_ ("could not find stream infomations: %s"), file);
-      avformat_close_input (&fmt_ctx);
-      return NULL;
+      if (avformat_find_stream_info (fmt_ctx, NULL) < 0)
+        {
+          g_warning (_ ("could not find stream infomations: %s"), file);
+          avformat_close_input (&fmt_ctx);
+          return -1;
+        }
+      s = av_find_best_stream (fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
     }
 
-  s = av_find_best_stream (fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
   if (s < 0)
     {
       g_warning (_ ("could not find audio stream: %s"), file);
       avformat_close_input (&fmt_ctx);
-      return NULL;
+      return -1;
     }
 
-  stream = fmt_ctx->streams[s];
+  *pfmt_ctx = fmt_ctx;
 
-  info = g_malloc0 (sizeof (audio_info));
+  return s;
+}
 
-  info->name = g_path_get_basename (file);
-  info->dir = g_path_get_dirname (file);
+/* describe stream s of an opened container */
+static void
+audio_probe_fill (AVFormatContext *fmt_ctx, int s, cache_probe_t *probe)
+{
+  AVStream *stream = fmt_ctx->streams[s];
+
+  memset (probe, 0, sizeof (cache_probe_t));
+  probe->type = FD_AUDIO;
   if (stream->duration != AV_NOPTS_VALUE)
     {
-      info->length = (double)(stream->duration * stream->time_base.num)
-                     / stream->time_base.den;
+      probe->duration = (double)(stream->duration * stream->time_base.num)
+                        / stream->time_base.den;
     }
-  else
+  else if (fmt_ctx->duration != AV_NOPTS_VALUE)
     {
-      info->length = (double)(fmt_ctx->duration) / AV_TIME_BASE;
+      probe->duration = (double)(fmt_ctx->duration) / AV_TIME_BASE;
     }
-  info->size[0] = stream->codecpar->width;
-  info->size[1] = stream->codecpar->height;
-  info->format = avcodec_get_name (stream->codecpar->codec_id);
+  probe->width = stream->codecpar->width;
+  probe->height = stream->codecpar->height;
+  g_strlcpy (probe->codec, avcodec_get_name (stream->codecpar->codec_id),
+             sizeof probe->codec);
+  probe->bitrate = stream->codecpar->bit_rate > 0 ? stream->codecpar->bit_rate
+                                                  : fmt_ctx->bit_rate;
+  probe->streams = fmt_ctx->nb_streams;
+}
 
+/* open the container of file and describe its best audio stream */
+static gboolean
+audio_probe (const char *file, cache_probe_t *probe)
+{
+  AVFormatContext *fmt_ctx = NULL;
+  int s;
+
+  s = audio_open (file, &fmt_ctx);
+  if (s < 0)
+    {
+      return FALSE;
+    }
+
+  audio_probe_fill (fmt_ctx, s, probe);
   avformat_close_input (&fmt_ctx);
 
+  return TRUE;
+}
+
+/* the cached probe of file, probing it only when it changed since */
+audio_info *
+audio_get_info (const char *file)
+{
+  audio_info *info;
+  cache_probe_t probe[1];
+
+  if (g_cache == NULL || !cache_get_probe (g_cache, file, FD_AUDIO, probe))
+    {
+      if (!audio_probe (file, probe))
+        {
+          return NULL;
+        }
+      if (g_cache)
+        {
+          cache_set_probe (g_cache, file, probe);
+        }
+    }
+
+  info = g_malloc0 (sizeof (audio_info));
+
+  info->name = g_path_get_basename (file);
+  info->dir = g_path_get_dirname (file);
+  info->length = probe->duration;
+  info->size[0] = probe->width;
+  info->size[1] = probe->height;
+  info->format = g_strdup (probe->codec);
+  info->bitrate = probe->bitrate;
+  info->streams = probe->streams;
+
   return info;
 }
 
@@ -95,6 +185,7 @@ audio_info_free (audio_info *info)
 {
   g_free (info->name);
   g_free (info->dir);
+  g_free (info->format);
   g_free (info);
 }
 
@@ -115,43 +206,43 @@ audio_get_length (const char *file)
   return length;
 }
 
-int
-audio_extract (const char *file, float offset, float length, int ar,
-               short **pBuffer, int *pLen)
+/* decode window seconds at the start, the middle and the end of file, or
+ * with no window length seconds from offset, see audio_extract_stream */
+static int
+audio_decode (const char *file, float window, float offset, float length,
+              int ar, audio_samples_func func, void *arg)
 {
   AVFormatContext *format_ctx = NULL;
   AVCodecContext *codec_ctx = NULL;
   AVStream *stream = NULL;
   const AVCodec *codec = NULL;
-  AVFrame *frame = NULL, *frame_s16 = NULL;
+  AVFrame *frame = NULL;
   AVPacket *packet = NULL;
   struct SwrContext *convert_ctx = NULL;
-  int s, ret, bytes = -1, want_samples, got_samples;
+  int s, ret, samples = -1, want_samples, got_samples, total_samples;
+  int span_samples, span, nspans;
+  int buf_size = 0;
+  short *buf = NULL;
+  uint8_t *out;
   int64_t seek_target;
-  float total_length;
-
+  float total_length, spans[FDUPVES_AUDIO_WINDOWS][2];
+  cache_probe_t probe[1];
 
-  if (avformat_open_input (&format_ctx, file, NULL, NULL) != 0)
+  s = audio_open (file, &format_ctx);
+  if (s < 0)
     {
-      g_warning (_ ("could not open: %s"), file);
       goto end;
     }
 
-  if (avformat_find_stream_info (format_ctx, NULL) < 0)
-    {
-      g_warning (_ ("could not find stream infomations: %s"), file);
-      goto end;
-    }
+  stream = format_ctx->streams[s];
 
-  s = av_find_best_stream (format_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
-  if (s < 0)
+  /* the file is open anyway, spare audio_get_info its own open */
+  if (g_cache && !cache_get_probe (g_cache, file, FD_AUDIO, probe))
     {
-      g_warning (_ ("could not find audio stream: %s"), file);
-      goto end;
+      audio_probe_fill (format_ctx, s, probe);
+      cache_set_probe (g_cache, file, probe);
     }
 
-  stream = format_ctx->streams[s];
-
   codec_ctx = avcodec_alloc_context3 (NULL);
   if (codec_ctx == NULL)
     {
@@ -167,6 +258,9 @@ audio_extract (const char *file, float offset, float length, int ar,
     }
 
   codec_ctx->pkt_timebase = stream->time_base;
+  /* the whole stream is decoded, frame threads pay off here */
+  codec_ctx->thread_count = fd_cpu_budget_decoder_threads ();
+  codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
   codec = avcodec_find_decoder (codec_ctx->codec_id);
   if (codec == NULL)
     {
@@ -181,31 +275,51 @@ audio_extract (const char *file, float offset, float length, int ar,
     }
 
   frame = av_frame_alloc ();
-  frame_s16 = av_frame_alloc ();
-  if (frame == NULL || frame_s16 == NULL)
+  if (frame == NULL)
     {
       g_warning (_ ("alloc frame error: %s"), file);
       goto end;
     }
 
+  total_length = -1.f;
   if (stream->duration != AV_NOPTS_VALUE)
     {
       total_length = (float)(stream->duration * stream->time_base.num)
                      / (float)stream->time_base.den;
     }
-  else
+  else if (format_ctx->duration != AV_NOPTS_VALUE)
     {
       total_length = (float)(format_ctx->duration) / AV_TIME_BASE;
     }
-  if (offset + length > total_length)
+
+  /* a negative span length decodes to the end, which the headers may not
+   * know; a file too short for three windows is decoded whole */
+  if (window > 0)
     {
-      length = total_length - offset;
+      nspans = 1;
+      spans[0][0] = 0.f;
+      spans[0][1] = -1.f;
+      if (total_length > FDUPVES_AUDIO_WINDOWS * window)
+        {
+          nspans = FDUPVES_AUDIO_WINDOWS;
+          spans[1][0] = (total_length - window) / 2;
+          spans[2][0] = total_length - window;
+          for (span = 0; span < nspans; ++span)
+            {
+              spans[span][1] = window;
+            }
+        }
+    }
+  else
+    {
+      if (length >= 0 && total_length >= 0 && offset + length > total_length)
+        {
+          length = MAX (total_length - offset, 0.f);
+        }
+      nspans = 1;
+      spans[0][0] = offset;
+      spans[0][1] = length;
     }
-
-  seek_target
-      = av_rescale ((int)offset, stream->time_base.den, stream->time_base.num);
-  avformat_seek_file (format_ctx, s, 0, seek_target, seek_target,
-                      AVSEEK_FLAG_FRAME);
 
   packet = av_packet_alloc ();
   if (packet == NULL)
@@ -255,90 +369,120 @@ audio_extract (const char *file, float offset, float length, int ar,
 
     }
 
-  /* initialize the resampling context */
-  if ((ret = swr_init (convert_ctx)) < 0)
+  /* below the full rate the fingerprint is a quick one, a short filter
+   * does for its resampling */
+  if (ar < FDUPVES_AUDIO_RATE)
     {
-      g_warning (_ ("Could not initialize resampler context\n"));
-      goto end;
+      av_opt_set_int (convert_ctx, "filter_size", 8, 0);
+      av_opt_set_int (convert_ctx, "phase_shift", 6, 0);
     }
 
-  *pLen = ar * length;
-  *pBuffer = g_new (short, *pLen);
-  if (*pBuffer == NULL)
+  /* initialize the resampling context */
+  if ((ret = swr_init (convert_ctx)) < 0)
     {
       g_warning (_ ("Could not initialize resampler context\n"));
       goto end;
     }
 
+  /* a frame of samples at a time goes to func, only buf is kept */
   got_samples = 0;
-  while (av_read_frame (format_ctx, packet) == 0)
+  for (span = 0; span < nspans; ++span)
     {
-      if (packet->stream_index != s)
+      if (span > 0)
         {
-          av_packet_unref (packet);
-          continue;
+          /* drop what the decoder and resampler hold of the last span */
+          avcodec_flush_buffers (codec_ctx);
+          swr_init (convert_ctx);
         }
 
-      if (avcodec_send_packet (codec_ctx, packet) != 0)
+      seek_target = av_rescale ((int)spans[span][0], stream->time_base.den,
+                                stream->time_base.num);
+      /* a span the seek missed would be decoded from the wrong place */
+      if (avformat_seek_file (format_ctx, s, 0, seek_target, seek_target,
+                              AVSEEK_FLAG_FRAME)
+              < 0
+          && spans[span][0] > 0)
         {
-          av_packet_unref (packet);
+          g_warning (_ ("Seek %s to %f error"), file, spans[span][0]);
           continue;
         }
 
-      av_packet_unref (packet);
-
-      ret = avcodec_receive_frame (codec_ctx, frame);
-      if (ret == AVERROR (EAGAIN))
+      total_samples
+          = spans[span][1] < 0 ? G_MAXINT : (int)(ar * spans[span][1]);
+      span_samples = 0;
+      while (span_samples < total_samples
+             && av_read_frame (format_ctx, packet) == 0)
         {
-          continue;
-        }
+          if (packet->stream_index != s)
+            {
+              av_packet_unref (packet);
+              continue;
+            }
 
-      if (ret != 0)
-        {
-          g_warning (_ ("Cannot receive frame from context"));
-          bytes = -1;
-          goto end;
-        }
+          if (avcodec_send_packet (codec_ctx, packet) != 0)
+            {
+              av_packet_unref (packet);
+              continue;
+            }
 
-      want_samples
-          = av_rescale_rnd (swr_get_delay (convert_ctx, codec_ctx->sample_rate)
-                                + frame->nb_samples,
-                            ar, codec_ctx->sample_rate, AV_ROUND_UP);
-      if (got_samples + want_samples > *pLen)
-        {
-          want_samples = *pLen - got_samples;
-        }
+          av_packet_unref (packet);
 
-      bytes = av_samples_fill_arrays (frame_s16->data, frame_s16->linesize,
-                                      (uint8_t *)*pBuffer
-                                          + got_samples * sizeof (short),
-                                      1, want_samples, AV_SAMPLE_FMT_S16, 1);
-      if (bytes < 0)
-        {
-          g_warning (_ ("Could not fill resampler buffer\n"));
-          bytes = -1;
-          goto end;
-        }
+          ret = avcodec_receive_frame (codec_ctx, frame);
+          if (ret == AVERROR (EAGAIN))
+            {
+              continue;
+            }
 
-      if ((ret
-           = swr_convert (convert_ctx, frame_s16->data, want_samples,
-                          (const uint8_t **)frame->data, frame->nb_samples))
-          < 0)
-        {
-          g_warning (_ ("Could not resample samples.\n"));
-          bytes = -1;
-          goto end;
+          if (ret != 0)
+            {
+              g_warning (_ ("Cannot receive frame from context"));
+              goto end;
+            }
+
+          want_samples = av_rescale_rnd (
+              swr_get_delay (convert_ctx, codec_ctx->sample_rate)
+                  + frame->nb_samples,
+              ar, codec_ctx->sample_rate, AV_ROUND_UP);
+          if (span_samples + want_samples > total_samples)
+            {
+              want_samples = total_samples - span_samples;
+            }
 
+          if (want_samples > buf_size)
+            {
+              g_free (buf);
+              buf_size = want_samples;
+              buf = g_new (short, buf_size);
+            }
+
+          out = (uint8_t *)buf;
+          if ((ret = swr_convert (convert_ctx, &out, want_samples,
+                                  (const uint8_t **)frame->data,
+                                  frame->nb_samples))
+              < 0)
+            {
+              g_warning (_ ("Could not resample samples.\n"));
+              goto end;
+            }
+
+          got_samples += ret;
+          span_samples += ret;
+          if (ret > 0 && func (buf, ret, arg) != 0)
+            {
+              span = nspans;
+              break;
+            }
         }
 
-      got_samples += ret;
-      if (got_samples == *pLen)
+      /* a call without samples ends the span */
+      if (span < nspans)
         {
-          bytes = sizeof (short) * *pLen;
-          break;
+          func (buf, 0, arg);
         }
     }
 
+  samples = got_samples;
+
 end:
   if (convert_ctx)
     {
@@ -349,10 +493,7 @@ end:
     {
       av_packet_free (&packet);
     }
-  if (frame_s16)
-    {
-      av_frame_free (&frame_s16);
-    }
+  g_free (buf);
   if (frame)
     {
       av_frame_free (&frame);
@@ -368,7 +509,69 @@ end:
       avformat_close_input (&format_ctx);
     }
 
-  return bytes;
+  return samples;
+}
+
+int
+audio_extract_stream (const char *file, float offset, float length, int ar,
+                      audio_samples_func func, void *arg)
+{
+  return audio_decode (file, 0.f, offset, length, ar, func, arg);
+}
+
+int
+audio_extract_windows (const char *file, float window, int ar,
+                       audio_samples_func func, void *arg)
+{
+  return audio_decode (file, window, 0.f, -1.f, ar, func, arg);
+}
+
+typedef struct
+{
+  short *buf;
+  int size;
+  int len;
+} audio_extract_buffer;
+
+static int
+audio_extract_append (const short *samples, int count, void *arg)
+{
+  audio_extract_buffer *buffer = arg;
+
+  if (count <= 0)
+    {
+      return 0;
+    }
+
+  count = MIN (count, buffer->size - buffer->len);
+  memcpy (buffer->buf + buffer->len, samples, count * sizeof (short));
+  buffer->len += count;
+
+  return 0;
+}
+
+int
+audio_extract (const char *file, float offset, float length, int ar,
+               short **pBuffer, int *pLen)
+{
+  audio_extract_buffer buffer[1];
+
+  buffer->size = ar * length;
+  buffer->buf = g_new (short, buffer->size);
+  buffer->len = 0;
+
+  if (audio_extract_stream (file, offset, length, ar, audio_extract_append,
+                            buffer)
+      <= 0)
+    {
+      g_free (buffer->buf);
+      return -1;
+    }
+
+  *pBuffer = buffer->buf;
+  *pLen = buffer->len;
+
+  return sizeof (short) * buffer->len;
 }
 
 struct wav_header
@@ -440,89 +643,231 @@ audio_extract_to_wav (const char *file, float offset, float length, int ar,
   return 0;
 }
 
+static gint
+audio_peak_hash_cmp (gconstpointer a, gconstpointer b)
+{
+  const audio_peak_hash *pa = *(audio_peak_hash *const *)a;
+  const audio_peak_hash *pb = *(audio_peak_hash *const *)b;
+
+  if (pa->hash != pb->hash)
+    {
+      return pa->hash < pb->hash ? -1 : 1;
+    }
+  return (pa->offset > pb->offset) - (pa->offset < pb->offset);
+}
+
+/* the landmarks of one window go to array */
+typedef struct
+{
+  hash_array_t *array;
+  int window;
+} audio_peak_append;
+
 static int
-audio_hash_peak_append (const char *hash, int offset, void *ptr)
+audio_hash_peak_append (guint32 hash, int offset, void *ptr)
 {
-  hash_array_t *array = (hash_array_t *)ptr;
+  audio_peak_append *append = (audio_peak_append *)ptr;
   audio_peak_hash peak;
 
-  snprintf (peak.hash, sizeof peak.hash, "%s", hash);
-  peak.offset = offset;
-  hash_array_append (array, &peak, sizeof (peak));
+  peak.hash = hash;
+  peak.offset = FDUPVES_AUDIO_OFFSET (append->window, offset);
+  hash_array_append (append->array, &peak, sizeof (peak));
 
   return 0;
 }
 
-hash_array_t *
-audio_fingerprint (const char *file)
+/* each window of a file goes through a stream of its own, so no landmark
+ * pairs peaks across the gap between two windows and offsets count from
+ * the start of their window */
+typedef struct
 {
-  int samples, memlen, i, amp_min;
-  float medialen;
-  short *buf;
-  float *datas;
-  hash_array_t *array;
+  int rate;
+  fingerprint_stream *stream;
+  GPtrArray *peaks;
+} audio_fingerprint_spans;
 
-  medialen = audio_get_length (file);
-  g_return_val_if_fail (medialen > 0, NULL);
-
-  memlen = audio_extract (file, 0.f, medialen, 22050, &buf, &samples);
-  g_return_val_if_fail (memlen > 0, NULL);
+static int
+audio_fingerprint_push (const short *samples, int count, void *arg)
+{
+  audio_fingerprint_spans *spans = arg;
 
-  datas = g_new (float, samples);
-  if (datas == NULL)
+  if (count > 0)
     {
-      g_free (buf);
-      return NULL;
+      if (spans->stream == NULL)
+        {
+          spans->stream
+              = fingerprint_stream_new (spans->rate, FDUPVES_AUDIO_AMP_MIN);
+        }
+      fingerprint_stream_push (spans->stream, samples, count);
+    }
+  else if (spans->stream)
+    {
+      g_ptr_array_add (spans->peaks,
+                       fingerprint_stream_finish (spans->stream));
+      spans->stream = NULL;
     }
 
-  for (i = 0; i < samples; ++i)
-    datas[i] = (float)(buf[i]);
+  return 0;
+}
 
-  for (array = NULL, amp_min = 50; amp_min >= 5; amp_min -= 5)
-    {
-      if (array)
-        hash_array_free (array);
-      array = hash_array_new ();
-      if (array == NULL)
-        break;
+hash_array_t *
+audio_fingerprint (const char *file, int rate, int window)
+{
+  int samples, amp_min, count;
+  float medialen;
+  guint i;
+  hash_array_t *array;
+  audio_fingerprint_spans spans[1];
+  audio_peak_append append[1];
+
+  /* the decoded samples go straight into the spectrogram, so memory does
+   * not grow with the length of the file, and the length is what was
+   * decoded, of the whole file or of its windows, rather than a second
+   * probe of the file */
+  spans->rate = rate;
+  spans->stream = NULL;
+  spans->peaks
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)fingerprint_peaks_free);
+  samples = audio_extract_windows (file, window, rate, audio_fingerprint_push,
+                                   spans);
+  /* the span a failed decode left open */
+  audio_fingerprint_push (NULL, 0, spans);
+  if (samples <= 0)
+    {
+      g_ptr_array_free (spans->peaks, TRUE);
+      return NULL;
+    }
+  medialen = samples / (float)rate;
 
-      fingerprint (datas, samples, 22050, amp_min, audio_hash_peak_append,
-                   array);
-      if (hash_array_size (array) > (((int)medialen) >> 2))
+  /* the loudest threshold from 50 down to FDUPVES_AUDIO_AMP_MIN that gives
+   * enough hashes, counted on the peaks found once */
+  for (amp_min = 50; amp_min > FDUPVES_AUDIO_AMP_MIN; amp_min -= 5)
+    {
+      for (count = 0, i = 0; i < spans->peaks->len; ++i)
+        {
+          count += fingerprint_peaks_hash_count (
+              g_ptr_array_index (spans->peaks, i), amp_min);
+        }
+      if (count > (((int)medialen) >> 2))
         break;
     }
 
-  g_free (buf);
-  g_free (datas);
+  array = hash_array_new ();
+  if (array)
+    {
+      append->array = array;
+      for (i = 0; i < spans->peaks->len; ++i)
+        {
+          append->window = i;
+          fingerprint_peaks_hashes (g_ptr_array_index (spans->peaks, i),
+                                    amp_min, audio_hash_peak_append, append);
+        }
+      hash_array_sort (array, audio_peak_hash_cmp);
+    }
+  g_ptr_array_free (spans->peaks, TRUE);
 
   return array;
 }
 
+static int
+audio_fingerprint_max_column (hash_array_t *array)
+{
+  audio_peak_hash *ph;
+  int i, max;
+
+  max = 0;
+  for (i = 0; i < hash_array_size (array); ++i)
+    {
+      ph = hash_array_index (array, i);
+      max = MAX (max, FDUPVES_AUDIO_OFFSET_COLUMN (ph->offset));
+    }
+
+  return max;
+}
+
+/* Both arrays are merge joined on the landmark, every pair found in the
+ * same window votes for the difference of its offsets in that window, and
+ * the score is the sum of the most voted difference of each window: copies
+ * line up at one shift a window while chance matches scatter, and the
+ * middle and end windows of copies of different lengths line up at shifts
+ * of their own.  A landmark of array1 votes at most once for each
+ * difference, so the score can grow by at most the landmarks of array1
+ * left. */
 int
-audio_fingerprint_similarity (hash_array_t *array1, hash_array_t *array2)
+audio_fingerprint_similarity (hash_array_t *array1, hash_array_t *array2,
+                              int need)
 {
-  int dis, i, j;
-  audio_peak_hash *ph1, *ph2;
+  int n1, n2, i, j, k, w, max2, width, score, *votes, v;
+  int best[FDUPVES_AUDIO_WINDOWS];
+  audio_peak_hash *ph1, *ph2, *ph;
 
   if (array1 == NULL || array2 == NULL)
     {
       return 0;
     }
 
-  dis = 0;
-  for (i = 0; i < hash_array_size (array1); ++i)
+  n1 = hash_array_size (array1);
+  n2 = hash_array_size (array2);
+  if (n1 == 0 || n2 == 0)
+    {
+      return 0;
+    }
+
+  /* window * width + column1 - column2 + max2 indexes the votes */
+  max2 = audio_fingerprint_max_column (array2);
+  width = audio_fingerprint_max_column (array1) + max2 + 1;
+  votes = g_new0 (int, FDUPVES_AUDIO_WINDOWS * width);
+  memset (best, 0, sizeof best);
+
+  score = 0;
+  for (i = 0, j = 0; i < n1 && j < n2;)
     {
       ph1 = hash_array_index (array1, i);
-      for (j = 0; j < hash_array_size (array2); ++j)
+      ph2 = hash_array_index (array2, j);
+      if (ph1->hash < ph2->hash)
+        {
+          ++i;
+        }
+      else if (ph1->hash > ph2->hash)
         {
-          ph2 = hash_array_index (array2, j);
-          if (strcmp (ph1->hash, ph2->hash) == 0)
+          ++j;
+        }
+      else
+        {
+          /* the run of this landmark in array2, j stays at its start for
+           * the next equal landmark of array1 */
+          w = FDUPVES_AUDIO_OFFSET_WINDOW (ph1->offset);
+          for (k = j; k < n2; ++k)
             {
-              dis++;
-              break;
+              ph = hash_array_index (array2, k);
+              if (ph->hash != ph1->hash)
+                {
+                  break;
+                }
+              if ((k > j && ph->offset == ph2->offset)
+                  || FDUPVES_AUDIO_OFFSET_WINDOW (ph->offset) != w
+                  || w >= FDUPVES_AUDIO_WINDOWS)
+                {
+                  continue;
+                }
+              ph2 = ph;
+              v = ++votes[w * width + FDUPVES_AUDIO_OFFSET_COLUMN (ph1->offset)
+                          - FDUPVES_AUDIO_OFFSET_COLUMN (ph->offset) + max2];
+              if (v > best[w])
+                {
+                  best[w] = v;
+                  ++score;
+                }
             }
+          ++i;
+        }
+
+      if (need > 0 && (score >= need || score + (n1 - i) < need))
+        {
+          break;
         }
     }
+  g_free (votes);
 
-  return dis;
+  return score;
 }
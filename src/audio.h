@@ -39,22 +39,41 @@ typedef struct
   char *dir;
 
   /* Format */
-  const char *format;
+  char *format;
 
   /* Duration */
   float length;
 
   /* Size */
   int size[2];
-} audio_info;
 
-#ifndef AUDIO_PEAK_HASH_LEN
-#define AUDIO_PEAK_HASH_LEN 12
-#endif
+  /* Bitrate */
+  gint64 bitrate;
+
+  /* Streams */
+  int streams;
+} audio_info;
 
+/* the rate audio is fingerprinted at, lower ones use a faster resampler */
+#define FDUPVES_AUDIO_RATE 22050
+
+/* the windows a windowed fingerprint takes of a file; a landmark keeps
+ * the one it is in above FDUPVES_AUDIO_WINDOW_SHIFT bits of its offset,
+ * the spectrogram column in that window below them */
+#define FDUPVES_AUDIO_WINDOWS 3
+#define FDUPVES_AUDIO_WINDOW_SHIFT 24
+#define FDUPVES_AUDIO_OFFSET(window, column)                                  \
+  (((window) << FDUPVES_AUDIO_WINDOW_SHIFT) | (column))
+#define FDUPVES_AUDIO_OFFSET_WINDOW(offset)                                   \
+  ((offset) >> FDUPVES_AUDIO_WINDOW_SHIFT)
+#define FDUPVES_AUDIO_OFFSET_COLUMN(offset)                                   \
+  ((offset) & ((1 << FDUPVES_AUDIO_WINDOW_SHIFT) - 1))
+
+/* a landmark of two spectrogram peaks, see FINGERPRINT_LANDMARK, and the
+ * window of the first one, see FDUPVES_AUDIO_OFFSET */
 typedef struct
 {
-  char hash[AUDIO_PEAK_HASH_LEN];
+  guint32 hash;
   int offset;
 } audio_peak_hash;
 
@@ -64,14 +83,36 @@ void audio_info_free (audio_info *info);
 
 float audio_get_length (const char *file);
 
+/* called with each run of decoded mono samples, and with none at the end
+ * of each span decoded, stops the decode by returning non-zero */
+typedef int (*audio_samples_func) (const short *samples, int count,
+                                   void *arg);
+
+/* decode length seconds from offset, or to the end when length is
+ * negative, at ar Hz a frame at a time, returns the number of samples or
+ * -1; the file is opened once and its probe cached on the way */
+int audio_extract_stream (const char *file, float offset, float length,
+                          int ar, audio_samples_func func, void *arg);
+
+/* the same for window seconds at the start, the middle and the end of
+ * file, or for all of it when it is shorter than the three */
+int audio_extract_windows (const char *file, float window, int ar,
+                           audio_samples_func func, void *arg);
+
 int audio_extract (const char *file, float offset, float length, int ar,
                    short **pBuffer, int *buf_len);
 
 int audio_extract_to_wav (const char *file, float offset, float length, int ar,
                           const char *out_wav);
 
-hash_array_t *audio_fingerprint (const char *file);
+/* the landmarks of file decoded at rate Hz, of its three windows of
+ * window seconds when window > 0, sorted by landmark then offset */
+hash_array_t *audio_fingerprint (const char *file, int rate, int window);
 
-int audio_fingerprint_similarity (hash_array_t *array1, hash_array_t *array2);
+/* the landmarks of array1 found in array2 at a single time shift for each
+ * window, both sorted as audio_fingerprint returns them; counting stops
+ * once need is reached or out of reach, need <= 0 counts them all */
+int audio_fingerprint_similarity (hash_array_t *array1, hash_array_t *array2,
+                                  int need);
 
 #endif
@@ -54,6 +54,8 @@ struct cache_s
 static gboolean cache_exec (cache_t *cache, int (*cb) (sqlite3_stmt *, void *),
                             void *arg, const char *sql, const char *fmt, ...);
 
+static int get_id_callback (sqlite3_stmt *stmt, void *para);
+
 const char *init_text
     = "create table media(id INTEGER PRIMARY KEY AUTOINCREMENT, path text, "
       "size bigint, mtime bigint);"
@@ -66,6 +68,25 @@ const char *init_text
       "producer varchar(256), pubdate_year integer, pubdate_mon integer, "
       "pubdate_day integer, isbn varchar(128));";
 
+/* schema changes after init_text, entry N moves user_version N to N + 1 */
+static const char *upgrade_texts[] = {
+  "alter table hash add column version integer default 0;",
+  "alter table hash add column bits integer default 64;",
+  "alter table hash add column sample_offset real;",
+  "alter table media add column probe_type integer;"
+  "alter table media add column duration real;"
+  "alter table media add column width integer;"
+  "alter table media add column height integer;"
+  "alter table media add column codec text;"
+  "alter table media add column bitrate bigint;"
+  "alter table media add column streams integer;",
+  "create table signature(id INTEGER PRIMARY KEY AUTOINCREMENT, media_id "
+  "integer, version integer, bits integer, alg integer, count integer, "
+  "hashes text);"
+  "create index index_signature on signature (media_id);",
+  "alter table signature add column times text;",
+};
+
 static void
 cache_init (cache_t *cache)
 {
@@ -80,6 +101,38 @@ cache_init (cache_t *cache)
     }
 }
 
+static void
+cache_upgrade (cache_t *cache)
+{
+  char *errmsg, *sql;
+  int version;
+
+  version = 0;
+  cache_exec (cache, get_id_callback, &version, "pragma user_version;", "");
+
+  for (; version < (int)G_N_ELEMENTS (upgrade_texts); ++version)
+    {
+      /* a step and its user_version bump commit together, so a step with
+       * several statements is never left half applied */
+      sql = g_strdup_printf ("begin;%spragma user_version = %d;commit;",
+                             upgrade_texts[version], version + 1);
+      errmsg = NULL;
+      if (sqlite3_exec (cache->db, sql, NULL, NULL, &errmsg) != 0)
+        {
+          g_warning ("upgrade cache file to version %d error: %s",
+                     version + 1, errmsg ? errmsg : "uknown");
+          if (errmsg)
+            {
+              sqlite3_free (errmsg);
+            }
+          sqlite3_exec (cache->db, "rollback;", NULL, NULL, NULL);
+          g_free (sql);
+          return;
+        }
+      g_free (sql);
+    }
+}
+
 cache_t *
 cache_open (const gchar *file)
 {
@@ -112,6 +165,7 @@ cache_open (const gchar *file)
     {
       cache_init (cache);
     }
+  cache_upgrade (cache);
 
   if (g_cache == NULL)
     {
@@ -206,19 +260,10 @@ get_id_callback (sqlite3_stmt *stmt, void *para)
   return 0;
 }
 
-static int
-get_hash_callback (sqlite3_stmt *stmt, void *para)
-{
-  hash_t *hp = (hash_t *)para;
-  *hp = sqlite3_column_int64 (stmt, 0);
-  return 0;
-}
-
 static int
 get_hash_array_callback (sqlite3_stmt *stmt, void *para)
 {
   audio_peak_hash hash;
-  const unsigned char *str;
   hash_array_t **pHashArray = (hash_array_t **)para;
 
   if (*pHashArray == NULL)
@@ -232,8 +277,7 @@ get_hash_array_callback (sqlite3_stmt *stmt, void *para)
     }
 
   hash.offset = sqlite3_column_int (stmt, 0);
-  str = sqlite3_column_text (stmt, 1);
-  snprintf (hash.hash, sizeof hash.hash, "%s", str);
+  hash.hash = (guint32)sqlite3_column_int64 (stmt, 1);
   hash_array_append (*pHashArray, &hash, sizeof (audio_peak_hash));
 
   return 0;
@@ -280,45 +324,407 @@ cache_get_media_id (cache_t *cache, const gchar *file)
   return media_id;
 }
 
-gboolean
-cache_get (cache_t *cache, const gchar *file, float off, int alg, hash_t *hp)
+struct hashes_result
+{
+  int bits;
+  int mask;
+  int got;
+  hash_t *hashes;
+  float *sample;
+};
+
+/* hashes wider than 64 bits are stored as hex text, word 0 first */
+static gboolean
+hash_words_parse (const unsigned char *str, hash_t *words, int count)
+{
+  int i;
+  gchar buf[17];
+
+  if (str == NULL || strlen ((const char *)str) != (gsize)count * 16)
+    {
+      return FALSE;
+    }
+
+  buf[16] = '\0';
+  for (i = 0; i < count; ++i)
+    {
+      memcpy (buf, str + i * 16, 16);
+      words[i] = g_ascii_strtoull (buf, NULL, 16);
+    }
+
+  return TRUE;
+}
+
+static int
+get_hashes_callback (sqlite3_stmt *stmt, void *para)
+{
+  struct hashes_result *result = para;
+  hash_t *h;
+  int alg, words;
+
+  alg = sqlite3_column_int (stmt, 0);
+  if (alg < 0 || alg >= FDUPVES_HASH_ALGS_CNT
+      || !(result->mask & FDUPVES_HASH_MASK (alg)))
+    {
+      return 0;
+    }
+
+  words = FDUPVES_HASH_WORDS (result->bits);
+  h = result->hashes + alg * words;
+  if (words == 1)
+    {
+      *h = sqlite3_column_int64 (stmt, 1);
+    }
+  else if (!hash_words_parse (sqlite3_column_text (stmt, 1), h, words))
+    {
+      return 0;
+    }
+
+  if (!hash_bits_is_zero (result->bits, h))
+    {
+      result->got |= FDUPVES_HASH_MASK (alg);
+      if (result->sample && sqlite3_column_type (stmt, 2) != SQLITE_NULL)
+        {
+          *result->sample = sqlite3_column_double (stmt, 2);
+        }
+    }
+  /* a zero hash with a sample offset is of cache_set_no_hashes, the hash
+   * is got, and left zero */
+  else if (sqlite3_column_type (stmt, 2) != SQLITE_NULL)
+    {
+      result->got |= FDUPVES_HASH_MASK (alg);
+    }
+
+  return 0;
+}
+
+/* fetch every bits wide hash in mask at off with one query, laid out as by
+ * image_file_hashes, and the time actually sampled for them into sample if
+ * not NULL, return the mask found */
+int
+cache_get_hashes (cache_t *cache, const gchar *file, float off, int version,
+                  int bits, int mask, hash_t *hashes, float *sample)
 {
   int media_id;
   gboolean ret;
+  struct hashes_result result[1];
+
+  media_id = cache_get_media_id (cache, file);
+  g_return_val_if_fail (media_id != -1, 0);
+
+  result->bits = bits;
+  result->mask = mask;
+  result->got = 0;
+  result->hashes = hashes;
+  result->sample = sample;
+  if (sample)
+    {
+      *sample = off;
+    }
+  ret = cache_exec (cache, get_hashes_callback, result,
+                    "select alg, hash, sample_offset from hash where offset=? "
+                    "and version=? and bits=? and media_id=?;",
+                    "%f %d %d %d", off, version, bits, media_id);
+  g_return_val_if_fail (ret, 0);
+
+  return result->got;
+}
+
+/* store every non-zero bits wide hash in mask at off, sampled at time
+ * sample, with one insert */
+gboolean
+cache_set_hashes (cache_t *cache, const gchar *file, float off, int version,
+                  int bits, int mask, const hash_t *hashes, float sample)
+{
+  int media_id, alg, words, i;
+  gboolean ret;
+  GString *sql;
+  const char *sep;
+  const hash_t *h;
 
   media_id = cache_get_media_id (cache, file);
   g_return_val_if_fail (media_id != -1, FALSE);
 
-  *hp = 0;
-  ret = cache_exec (
-      cache, get_hash_callback, hp,
-      "select hash from hash where offset=? and alg=? and media_id=?",
-      "%f %d %d", off, alg, media_id);
+  words = FDUPVES_HASH_WORDS (bits);
+  sql = g_string_new ("insert into hash(media_id, offset, sample_offset, "
+                      "alg, version, bits, hash) values");
+  sep = "";
+  for (alg = 0; alg < FDUPVES_HASH_ALGS_CNT; ++alg)
+    {
+      h = hashes + alg * words;
+      if (!(mask & FDUPVES_HASH_MASK (alg)) || hash_bits_is_zero (bits, h))
+        {
+          continue;
+        }
+
+      g_string_append_printf (sql, "%s(%d, ?1, ?2, %d, %d, %d, ", sep,
+                              media_id, alg, version, bits);
+      if (words == 1)
+        {
+          g_string_append_printf (sql, "%" G_GINT64_FORMAT ")", (gint64)*h);
+        }
+      else
+        {
+          g_string_append_c (sql, '\'');
+          for (i = 0; i < words; ++i)
+            {
+              g_string_append_printf (sql, "%016" G_GINT64_MODIFIER "x",
+                                      (guint64)h[i]);
+            }
+          g_string_append (sql, "')");
+        }
+      sep = ", ";
+    }
+  if (*sep == '\0')
+    {
+      g_string_free (sql, TRUE);
+      return TRUE;
+    }
+  g_string_append_c (sql, ';');
+
+  /* every row shares the offsets, bound once as ?1 and ?2 */
+  ret = cache_exec (cache, NULL, NULL, sql->str, "%f %f", off, sample);
+  g_string_free (sql, TRUE);
   g_return_val_if_fail (ret, FALSE);
 
-  return *hp != 0;
+  return TRUE;
 }
 
+/* remember that off has no frame worth hashing, a zero hash for each alg
+ * in mask which cache_get_hashes returns as got, so the frames around off
+ * are not decoded again on every run */
 gboolean
-cache_set (cache_t *cache, const gchar *file, float off, int alg, hash_t h)
+cache_set_no_hashes (cache_t *cache, const gchar *file, float off,
+                     int version, int bits, int mask)
 {
-  int media_id;
+  int media_id, alg, words;
   gboolean ret;
+  GString *sql;
+  gchar *zero;
+  const char *sep;
 
   media_id = cache_get_media_id (cache, file);
   g_return_val_if_fail (media_id != -1, FALSE);
 
-  ret = cache_exec (
-      cache, NULL, NULL,
-      "insert into hash(media_id, offset, alg, hash) values(?, ?, ?, ?);",
-      "%d %f %d %l", media_id, off, alg, h);
+  words = FDUPVES_HASH_WORDS (bits);
+  zero = words == 1 ? g_strdup ("0")
+                    : g_strdup_printf ("'%0*d'", words * 16, 0);
+  sql = g_string_new ("insert into hash(media_id, offset, sample_offset, "
+                      "alg, version, bits, hash) values");
+  sep = "";
+  for (alg = 0; alg < FDUPVES_HASH_ALGS_CNT; ++alg)
+    {
+      if (mask & FDUPVES_HASH_MASK (alg))
+        {
+          g_string_append_printf (sql, "%s(%d, ?1, ?1, %d, %d, %d, %s)", sep,
+                                  media_id, alg, version, bits, zero);
+          sep = ", ";
+        }
+    }
+  g_free (zero);
+  if (*sep == '\0')
+    {
+      g_string_free (sql, TRUE);
+      return TRUE;
+    }
+  g_string_append_c (sql, ';');
+
+  ret = cache_exec (cache, NULL, NULL, sql->str, "%f", off);
+  g_string_free (sql, TRUE);
   g_return_val_if_fail (ret, FALSE);
 
   return TRUE;
 }
 
+struct signature_result
+{
+  hash_t *hashes;
+  int words;
+  gboolean got;
+};
+
+static int
+get_signature_callback (sqlite3_stmt *stmt, void *para)
+{
+  struct signature_result *result = (struct signature_result *)para;
+
+  result->got = hash_words_parse (sqlite3_column_text (stmt, 0),
+                                  result->hashes, result->words);
+  return 0;
+}
+
+/* the count frame signature of file, count bits wide alg hashes in one
+ * row, return FALSE when there is none */
 gboolean
-cache_gets (cache_t *cache, const gchar *file, int alg,
+cache_get_signature (cache_t *cache, const gchar *file, int version,
+                     int bits, int alg, int count, hash_t *hashes)
+{
+  int media_id;
+  struct signature_result result[1];
+
+  media_id = cache_get_media_id (cache, file);
+  g_return_val_if_fail (media_id != -1, FALSE);
+
+  result->hashes = hashes;
+  result->words = count * FDUPVES_HASH_WORDS (bits);
+  result->got = FALSE;
+  cache_exec (cache, get_signature_callback, result,
+              "select hashes from signature where media_id=? and version=? "
+              "and bits=? and alg=? and count=?;",
+              "%d %d %d %d %d", media_id, version, bits, alg, count);
+
+  return result->got;
+}
+
+gboolean
+cache_set_signature (cache_t *cache, const gchar *file, int version,
+                     int bits, int alg, int count, const hash_t *hashes)
+{
+  int media_id, words, i;
+  GString *text;
+  gboolean ret;
+
+  media_id = cache_get_media_id (cache, file);
+  g_return_val_if_fail (media_id != -1, FALSE);
+
+  words = count * FDUPVES_HASH_WORDS (bits);
+  text = g_string_sized_new (words * 16);
+  for (i = 0; i < words; ++i)
+    {
+      g_string_append_printf (text, "%016" G_GINT64_MODIFIER "x",
+                              (guint64)hashes[i]);
+    }
+
+  cache_exec (cache, NULL, NULL,
+              "delete from signature where media_id=? and version=? and "
+              "bits=? and alg=? and count=?;",
+              "%d %d %d %d %d", media_id, version, bits, alg, count);
+  ret = cache_exec (cache, NULL, NULL,
+                    "insert into signature(media_id, version, bits, alg, "
+                    "count, hashes) values(?, ?, ?, ?, ?, ?);",
+                    "%d %d %d %d %d %s", media_id, version, bits, alg, count,
+                    text->str);
+  g_string_free (text, TRUE);
+
+  return ret;
+}
+
+struct timeline_result
+{
+  int words;
+  float **times;
+  hash_t **hashes;
+  int *count;
+};
+
+static int
+get_timeline_callback (sqlite3_stmt *stmt, void *para)
+{
+  struct timeline_result *result = (struct timeline_result *)para;
+  const char *p;
+  gchar *end;
+  int n, i;
+
+  n = sqlite3_column_int (stmt, 0);
+  p = (const char *)sqlite3_column_text (stmt, 2);
+  if (n <= 0 || p == NULL)
+    {
+      return 0;
+    }
+
+  *result->times = g_new (float, n);
+  *result->hashes = g_new (hash_t, n * result->words);
+  for (i = 0; i < n; ++i)
+    {
+      (*result->times)[i] = g_ascii_strtod (p, &end);
+      if (end == p)
+        {
+          break;
+        }
+      p = end;
+    }
+  if (i < n
+      || !hash_words_parse (sqlite3_column_text (stmt, 1), *result->hashes,
+                            n * result->words))
+    {
+      g_clear_pointer (result->times, g_free);
+      g_clear_pointer (result->hashes, g_free);
+      return 0;
+    }
+  *result->count = n;
+
+  return 0;
+}
+
+/* the timeline of file, a bits wide alg hash at each of *count times, in
+ * newly allocated arrays; return FALSE when there is none */
+gboolean
+cache_get_timeline (cache_t *cache, const gchar *file, int version, int bits,
+                    int alg, float **times, hash_t **hashes, int *count)
+{
+  int media_id;
+  struct timeline_result result[1];
+
+  media_id = cache_get_media_id (cache, file);
+  g_return_val_if_fail (media_id != -1, FALSE);
+
+  *times = NULL;
+  *hashes = NULL;
+  *count = 0;
+  result->words = FDUPVES_HASH_WORDS (bits);
+  result->times = times;
+  result->hashes = hashes;
+  result->count = count;
+  cache_exec (cache, get_timeline_callback, result,
+              "select count, hashes, times from signature where media_id=? "
+              "and version=? and bits=? and alg=? and times is not null;",
+              "%d %d %d %d", media_id, version, bits, alg);
+
+  return *count > 0;
+}
+
+gboolean
+cache_set_timeline (cache_t *cache, const gchar *file, int version, int bits,
+                    int alg, const float *times, const hash_t *hashes,
+                    int count)
+{
+  int media_id, words, i;
+  GString *text, *timetext;
+  gboolean ret;
+
+  media_id = cache_get_media_id (cache, file);
+  g_return_val_if_fail (media_id != -1, FALSE);
+
+  words = count * FDUPVES_HASH_WORDS (bits);
+  text = g_string_sized_new (words * 16);
+  for (i = 0; i < words; ++i)
+    {
+      g_string_append_printf (text, "%016" G_GINT64_MODIFIER "x",
+                              (guint64)hashes[i]);
+    }
+  timetext = g_string_sized_new (count * 8);
+  for (i = 0; i < count; ++i)
+    {
+      g_string_append_printf (timetext, "%s%.3f", i ? " " : "", times[i]);
+    }
+
+  cache_exec (cache, NULL, NULL,
+              "delete from signature where media_id=? and version=? and "
+              "bits=? and alg=? and times is not null;",
+              "%d %d %d %d", media_id, version, bits, alg);
+  ret = cache_exec (cache, NULL, NULL,
+                    "insert into signature(media_id, version, bits, alg, "
+                    "count, hashes, times) values(?, ?, ?, ?, ?, ?, ?);",
+                    "%d %d %d %d %d %s %s", media_id, version, bits, alg,
+                    count, text->str, timetext->str);
+  g_string_free (text, TRUE);
+  g_string_free (timetext, TRUE);
+
+  return ret;
+}
+
+gboolean
+cache_gets (cache_t *cache, const gchar *file, int alg, int version,
             hash_array_t **pHashArray)
 {
   int media_id;
@@ -330,15 +736,16 @@ cache_gets (cache_t *cache, const gchar *file, int alg,
   *pHashArray = NULL;
   ret = cache_exec (
       cache, get_hash_array_callback, pHashArray,
-      "select offset, hash from hash where alg = ? and media_id = ?;", "%d %d",
-      alg, media_id);
+      "select offset, hash from hash where alg = ? and version = ? and "
+      "media_id = ? order by hash, offset;",
+      "%d %d %d", alg, version, media_id);
   g_return_val_if_fail (ret, FALSE);
 
   return (*pHashArray != NULL);
 }
 
 gboolean
-cache_sets (cache_t *cache, const gchar *file, int alg,
+cache_sets (cache_t *cache, const gchar *file, int alg, int version,
             hash_array_t *hashArray)
 {
   int media_id, i;
@@ -352,16 +759,115 @@ cache_sets (cache_t *cache, const gchar *file, int alg,
     {
       hash = hash_array_index (hashArray, i);
       ret = cache_exec (cache, NULL, NULL,
-                        "insert into hash(media_id, offset, alg, hash) "
-                        "values(?, ?, ?, ?);",
-                        "%d, %d, %d, %l", media_id, hash->offset, alg,
-                        hash->hash);
+                        "insert into hash(media_id, offset, alg, version, "
+                        "hash) values(?, ?, ?, ?, ?);",
+                        "%d, %d, %d, %d, %l", media_id, hash->offset, alg,
+                        version, (gint64)hash->hash);
       g_return_val_if_fail (ret, FALSE);
     }
 
   return TRUE;
 }
 
+struct probe_result
+{
+  cache_probe_t *probe;
+  gint64 size;
+  gint64 mtime;
+  gboolean got;
+};
+
+static int
+get_probe_callback (sqlite3_stmt *stmt, void *para)
+{
+  struct probe_result *result = (struct probe_result *)para;
+  const unsigned char *codec;
+
+  /* the file changed since it was probed */
+  if (sqlite3_column_int64 (stmt, 6) != result->size
+      || sqlite3_column_int64 (stmt, 7) != result->mtime)
+    {
+      return 0;
+    }
+
+  result->probe->duration = sqlite3_column_double (stmt, 0);
+  result->probe->width = sqlite3_column_int (stmt, 1);
+  result->probe->height = sqlite3_column_int (stmt, 2);
+  codec = sqlite3_column_text (stmt, 3);
+  g_strlcpy (result->probe->codec, codec ? (const char *)codec : "",
+             sizeof result->probe->codec);
+  result->probe->bitrate = sqlite3_column_int64 (stmt, 4);
+  result->probe->streams = sqlite3_column_int (stmt, 5);
+  result->got = TRUE;
+
+  return 0;
+}
+
+/* the type probe of file, if it was probed since it last changed */
+gboolean
+cache_get_probe (cache_t *cache, const gchar *file, int type,
+                 cache_probe_t *probe)
+{
+  GStatBuf buf[1];
+  struct probe_result result[1];
+
+  if (g_stat (file, buf) != 0)
+    {
+      return FALSE;
+    }
+
+  memset (probe, 0, sizeof (cache_probe_t));
+  probe->type = type;
+  result->probe = probe;
+  result->size = buf->st_size;
+#if WIN32
+  result->mtime = buf->st_mtime;
+#else
+  result->mtime = buf->st_mtim.tv_sec;
+#endif
+  result->got = FALSE;
+  cache_exec (cache, get_probe_callback, result,
+              "select duration, width, height, codec, bitrate, streams, "
+              "size, mtime from media where path=? and probe_type=? and "
+              "duration is not null;",
+              "%s %d", file, type);
+
+  return result->got;
+}
+
+gboolean
+cache_set_probe (cache_t *cache, const gchar *file,
+                 const cache_probe_t *probe)
+{
+  int media_id;
+  GStatBuf buf[1];
+  long mtime;
+
+  if (g_stat (file, buf) != 0)
+    {
+      g_warning ("stat error: %s", strerror (errno));
+      return FALSE;
+    }
+#if WIN32
+  mtime = buf->st_mtime;
+#else
+  mtime = buf->st_mtim.tv_sec;
+#endif
+
+  media_id = cache_get_media_id (cache, file);
+  g_return_val_if_fail (media_id != -1, FALSE);
+
+  /* size and mtime are those of the file probed */
+  return cache_exec (cache, NULL, NULL,
+                     "update media set probe_type=?, duration=?, width=?, "
+                     "height=?, codec=?, bitrate=?, streams=?, size=?, "
+                     "mtime=? where id=?;",
+                     "%d %f %d %d %s %l %d %l %l %d", probe->type,
+                     probe->duration, probe->width, probe->height,
+                     probe->codec, (long)probe->bitrate, probe->streams,
+                     (long)buf->st_size, mtime, media_id);
+}
+
 gboolean
 cache_set_ebook (cache_t *cache, const char *file, ebook_hash_t *h)
 {
@@ -436,6 +942,8 @@ cache_remove_by_id (cache_t *cache, int media_id)
               media_id);
   cache_exec (cache, NULL, NULL, "delete from hash where media_id=?;", "%d",
               media_id);
+  cache_exec (cache, NULL, NULL, "delete from signature where media_id=?;",
+              "%d", media_id);
 
   cache_exec (cache, NULL, NULL, "delete from media where id=?;", "%d",
               media_id);
@@ -34,17 +34,65 @@
 
 typedef struct cache_s cache_t;
 
+/* what probing the container of a media file found, kept in its media row
+ * so the file is not opened again just to know it */
+typedef struct
+{
+  /* FD_VIDEO or FD_AUDIO, the kind of stream described */
+  int type;
+
+  /* Duration in seconds */
+  double duration;
+
+  /* Size, 0 for audio */
+  int width;
+  int height;
+
+  /* Codec name */
+  char codec[32];
+
+  /* bits per second of the stream, or of the whole file */
+  gint64 bitrate;
+
+  /* streams in the container */
+  int streams;
+} cache_probe_t;
+
 cache_t *cache_open (const gchar *file);
 
 void cache_close (cache_t *cache);
 
-gboolean cache_get (cache_t *, const gchar *, float, int, hash_t *);
+int cache_get_hashes (cache_t *, const gchar *, float, int version, int bits,
+                      int mask, hash_t *, float *sample);
+
+gboolean cache_set_hashes (cache_t *, const gchar *, float, int version,
+                           int bits, int mask, const hash_t *, float sample);
+
+gboolean cache_set_no_hashes (cache_t *, const gchar *, float, int version,
+                              int bits, int mask);
+
+gboolean cache_get_signature (cache_t *, const gchar *, int version, int bits,
+                              int alg, int count, hash_t *);
+
+gboolean cache_set_signature (cache_t *, const gchar *, int version, int bits,
+                              int alg, int count, const hash_t *);
+
+gboolean cache_get_timeline (cache_t *, const gchar *, int version, int bits,
+                             int alg, float **times, hash_t **, int *count);
+
+gboolean cache_set_timeline (cache_t *, const gchar *, int version, int bits,
+                             int alg, const float *times, const hash_t *,
+                             int count);
+
+gboolean cache_gets (cache_t *, const gchar *, int alg, int version,
+                     hash_array_t **);
 
-gboolean cache_set (cache_t *, const gchar *, float, int, hash_t);
+gboolean cache_sets (cache_t *, const gchar *, int alg, int version,
+                     hash_array_t *);
 
-gboolean cache_gets (cache_t *, const gchar *, int alg, hash_array_t **);
+gboolean cache_get_probe (cache_t *, const gchar *, int type, cache_probe_t *);
 
-gboolean cache_sets (cache_t *, const gchar *, int alg, hash_array_t *);
+gboolean cache_set_probe (cache_t *, const gchar *, const cache_probe_t *);
 
 gboolean cache_set_ebook (cache_t *, const char *, ebook_hash_t *h);
 
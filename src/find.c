@@ -33,6 +33,7 @@
 #include "util.h"
 #include "video.h"
 
+#include <math.h>
 #include <string.h>
 
 #ifndef FD_COMP_CNT
@@ -41,8 +42,9 @@
 
 struct st_hash
 {
-  int seek;
-  hash_t hash;
+  /* time of the frame actually hashed */
+  float seek;
+  hash_t hash[FDUPVES_HASH_WORDS (FDUPVES_HASH_BITS_MAX)];
 };
 
 struct st_file
@@ -53,11 +55,92 @@ struct st_file
   struct st_hash head[1];
   struct st_hash tail[1];
   hash_array_t *hashArray;
+  struct st_video *video;
+};
+
+/* every group entry of one video, hashed together so the file is opened
+ * once whatever the number of groups it falls into */
+struct st_video
+{
+  const char *path;
+  int count;
+  struct st_file *files[0x10];
+  /* bit i set for each group i of video_timers the video falls into */
+  guint groups;
+  /* signature_count frames every signature_step seconds over the whole
+   * file, frames of them got */
+  hash_t *signature;
+  int signature_count;
+  float signature_step;
+  int frames;
+};
+
+struct st_images
+{
+  GPtrArray *ptr;
+  int bits;
+  hash_t *hashs;
+  gint done;
+};
+
+/* a video of clip search, with about a hash per second of it */
+struct st_timeline
+{
+  const char *path;
+  float length;
+  float *times;
+  hash_t *hashes;
+  int count;
+};
+
+struct st_timelines
+{
+  GPtrArray *ptr;
+  int bits;
+  gint done;
+};
+
+/* a frame of a clip near a frame of another video, the offset is the time
+ * the clip starts at in that video */
+struct st_clip_vote
+{
+  guint video;
+  gint offset;
+  guint entry;
+};
+
+/* a hash value shared by more than one in FD_STOP_LIST_SHARE files, and
+ * by more than FD_STOP_LIST_MIN, is a solid colour or a blank page rather
+ * than a picture */
+#define FD_STOP_LIST_SHARE 100
+#define FD_STOP_LIST_MIN 16
+
+struct st_stop_list
+{
+  const hash_t *hashes;
+  int words;
+};
+
+/* each 64 bit hash word is split into same_video_distance bands for the
+ * clip index, so that hashes close enough to match share a band, but into
+ * no more than FD_CLIP_BANDS_MAX lest a band be too narrow to pick out
+ * anything, and no fewer than FD_CLIP_BANDS_MIN lest a key be too wide */
+#define FD_CLIP_BANDS_MIN 4
+#define FD_CLIP_BANDS_MAX 8
+
+/* the probe stage, durations land at the index of their file */
+struct st_probe
+{
+  GPtrArray *ptr;
+  int type;
+  float *lengths;
+  gint done;
 };
 
 struct st_find
 {
   GPtrArray *ptr[0x10];
+  GPtrArray *videos;
   find_type type;
   find_step *step;
   find_step_cb cb;
@@ -65,55 +148,368 @@ struct st_find
   gpointer arg;
 };
 
-static void find_video_prepare (const gchar *file, struct st_find *find);
+static float *find_probe (GPtrArray *ptr, int type, find_step *step,
+                          find_step_cb cb, gpointer arg);
+
+static void find_video_prepare (const gchar *file, float length,
+                                struct st_find *find);
 
 static void find_audio_prepare (const gchar *file, struct st_find *find);
 
-static int video_hash_func (struct st_file *file);
+static void probe_func (gpointer index, struct st_probe *probe);
+
+static void timeline_hash_func (gpointer index,
+                                struct st_timelines *timelines);
+
+static void st_timeline_free (struct st_timeline *);
+
+static GHashTable *find_clip_index (GPtrArray *ptr, int bits);
+
+static int find_clip_matches (GPtrArray *ptr, GHashTable *index, guint a,
+                              int bits, find_step *step, find_step_cb cb,
+                              gpointer arg);
+
+static GHashTable *find_audio_index (GPtrArray *ptr);
+
+static int find_audio_matches (GPtrArray *ptr, GHashTable *index, guint a,
+                               guint *counts, guint *seen, GArray *touched,
+                               find_step *step, find_step_cb cb,
+                               gpointer arg);
+
+static void image_hash_func (gpointer index, struct st_images *images);
+
+static void video_hash_func (struct st_video *video, gpointer unused);
 
 static int audio_hashes_func (struct st_file *file);
 
 static void st_file_free (struct st_file *);
 
+static void st_video_free (struct st_video *);
+
+/* longest first */
+static int
+st_video_length_cmp (struct st_video **a, struct st_video **b)
+{
+  float al = (*a)->files[0]->length, bl = (*b)->files[0]->length;
+
+  return (al < bl) - (al > bl);
+}
+
+/* the same_*_distance settings count differing bits of a 64 bit hash, keep
+ * the same ratio for wider ones */
+static int
+find_hash_distance (int distance, int bits)
+{
+  return distance * FDUPVES_HASH_WORDS (bits);
+}
+
+/* a hash with almost no bit set, or almost every bit, is of a near uniform
+ * picture: it carries little more than its brightness */
+static gboolean
+find_hash_flat (const hash_t *h, int bits)
+{
+  int i, ones;
+
+  for (ones = 0, i = 0; i < FDUPVES_HASH_WORDS (bits); ++i)
+    {
+      ones += hash_popcount (h[i]);
+    }
+
+  return ones <= bits / 16 || ones >= bits - bits / 16;
+}
+
+/* by hash value, then by index */
+static int
+stop_list_cmp (const gsize *a, const gsize *b, struct st_stop_list *list)
+{
+  int i;
+  const hash_t *ha, *hb;
+
+  ha = list->hashes + *a * list->words;
+  hb = list->hashes + *b * list->words;
+  for (i = 0; i < list->words; ++i)
+    {
+      if (ha[i] != hb[i])
+        {
+          return ha[i] < hb[i] ? -1 : 1;
+        }
+    }
+
+  return (*a > *b) - (*a < *b);
+}
+
+/* report the files of idx[from, to) as one group of type, paths[idx[from]]
+ * with each of the others */
+static void
+find_stop_list_report (const gsize *idx, gsize from, gsize to,
+                       const gchar **paths, same_type type, find_step *step,
+                       find_step_cb cb, gpointer arg)
+{
+  gsize k;
+
+  for (k = from + 1; k < to; ++k)
+    {
+      step->found = TRUE;
+      step->afile = paths[idx[from]];
+      step->bfile = paths[idx[k]];
+      step->type = type;
+      cb (step, arg);
+    }
+}
+
+/* take the hashes[n] that say little out of the all-pairs compare: values
+ * too many files share, and those of near uniform pictures.  Each shared
+ * value is one group; the near uniform ones go to a bucket of their own
+ * where each is grouped with the others of the bucket within dist of it.
+ * When paths is not NULL every group is reported, of type, as its first
+ * file with each of the others rather than as every pair of them.  The
+ * hashes are then zeroed, which no compare matches; return the groups
+ * reported */
+static int
+find_stop_list (hash_t *hashes, gsize n, int bits, int dist,
+                const gchar **paths, same_type type, find_step *step,
+                find_step_cb cb, gpointer arg)
+{
+  struct st_stop_list list[1];
+  GArray *order, *flat;
+  gsize *idx, i, j, k, limit;
+  hash_t area[FDUPVES_HASH_WORDS (FDUPVES_HASH_BITS_MAX)];
+  int count;
+
+  list->hashes = hashes;
+  list->words = FDUPVES_HASH_WORDS (bits);
+
+  order = g_array_sized_new (FALSE, FALSE, sizeof (gsize), n);
+  for (i = 0; i < n; ++i)
+    {
+      if (!hash_bits_is_zero (bits, hashes + i * list->words))
+        {
+          g_array_append_val (order, i);
+        }
+    }
+  g_array_sort_with_data (order, (GCompareDataFunc)stop_list_cmp, list);
+  idx = (gsize *)order->data;
+
+  flat = g_array_new (FALSE, FALSE, sizeof (gsize));
+  limit = MAX (FD_STOP_LIST_MIN, n / FD_STOP_LIST_SHARE);
+  count = 0;
+  for (i = 0; i < order->len; i = j)
+    {
+      for (j = i + 1; j < order->len
+                      && memcmp (hashes + idx[i] * list->words,
+                                 hashes + idx[j] * list->words,
+                                 sizeof (hash_t) * list->words)
+                             == 0;
+           ++j)
+        ;
+
+      if (j - i <= limit)
+        {
+          if (find_hash_flat (hashes + idx[i] * list->words, bits))
+            {
+              g_array_append_vals (flat, idx + i, j - i);
+            }
+          continue;
+        }
+
+      if (paths)
+        {
+          find_stop_list_report (idx, i, j, paths, type, step, cb, arg);
+          ++count;
+        }
+
+      for (k = i; k < j; ++k)
+        {
+          memset (hashes + idx[k] * list->words, 0,
+                  sizeof (hash_t) * list->words);
+        }
+    }
+
+  /* group the near uniform bucket: each hash not grouped yet takes the
+   * later ones within dist to the front of the rest; a group is reported
+   * once it is complete, and the bucket is compared with nothing else */
+  idx = (gsize *)flat->data;
+  hash_area_mask (g_ini->compare_area, bits, area);
+  for (i = 0; i < flat->len; i = j)
+    {
+      for (j = i + 1, k = i + 1; k < flat->len; ++k)
+        {
+          if (hash_bits_distance (bits, hashes + idx[i] * list->words,
+                                  hashes + idx[k] * list->words, area)
+              < dist)
+            {
+              gsize t = idx[j];
+              idx[j++] = idx[k];
+              idx[k] = t;
+            }
+        }
+
+      if (paths && j - i > 1)
+        {
+          find_stop_list_report (idx, i, j, paths, type, step, cb, arg);
+          ++count;
+        }
+    }
+  for (i = 0; i < flat->len; ++i)
+    {
+      memset (hashes + idx[i] * list->words, 0,
+              sizeof (hash_t) * list->words);
+    }
+  g_array_free (flat, TRUE);
+  g_array_free (order, TRUE);
+
+  return count;
+}
+
+/* the signature frames of video on the grid of step seconds, a multiple of
+ * its own step, into out; the frames of them got to *got, return their
+ * count */
+static int
+find_signature_on_grid (struct st_video *video, float step, int bits,
+                        hash_t *out, int *got)
+{
+  int k, n, ratio, words;
+  const hash_t *h;
+
+  words = FDUPVES_HASH_WORDS (bits);
+  ratio = (int)(step / video->signature_step + 0.5f);
+  n = video->signature_count / ratio;
+  for (*got = 0, k = 0; k < n; ++k)
+    {
+      /* (k + 1) * step is frame (k + 1) * ratio - 1 of the video */
+      h = video->signature + ((k + 1) * ratio - 1) * words;
+      memcpy (out + k * words, h, sizeof (hash_t) * words);
+      if (!hash_bits_is_zero (bits, h))
+        {
+          ++*got;
+        }
+    }
+
+  return n;
+}
+
+/* stop-list the head hashes and the tail hashes of the files of a video
+ * group, as find_stop_list; a black opening or a credits card the files
+ * share is reported once for them rather than pair by pair, return the
+ * groups reported */
+static int
+find_video_stop_list (GPtrArray *files, int bits, int dist, find_step *step,
+                      find_step_cb cb, gpointer arg)
+{
+  struct st_file *file;
+  hash_t *heads, *tails;
+  const gchar **paths;
+  gsize i;
+  int words, count;
+
+  words = FDUPVES_HASH_WORDS (bits);
+  heads = g_new (hash_t, files->len * words);
+  tails = g_new (hash_t, files->len * words);
+  paths = g_new (const gchar *, files->len);
+  for (i = 0; i < files->len; ++i)
+    {
+      file = g_ptr_array_index (files, i);
+      memcpy (heads + i * words, file->head->hash, sizeof (hash_t) * words);
+      memcpy (tails + i * words, file->tail->hash, sizeof (hash_t) * words);
+      paths[i] = file->path;
+    }
+
+  count = find_stop_list (heads, files->len, bits, dist, paths,
+                          FD_SAME_VIDEO_HEAD, step, cb, arg);
+  count += find_stop_list (tails, files->len, bits, dist, paths,
+                           FD_SAME_VIDEO_TAIL, step, cb, arg);
+
+  for (i = 0; i < files->len; ++i)
+    {
+      file = g_ptr_array_index (files, i);
+      memcpy (file->head->hash, heads + i * words, sizeof (hash_t) * words);
+      memcpy (file->tail->hash, tails + i * words, sizeof (hash_t) * words);
+    }
+  g_free (paths);
+  g_free (heads);
+  g_free (tails);
+
+  return count;
+}
+
 int
 find_images (GPtrArray *ptr, find_step_cb cb, gpointer arg)
 {
   size_t i, j;
-  int dist, count;
-  hash_t *hashs;
+  int dist, count, bits, words;
+  hash_t *hashs, area[FDUPVES_HASH_WORDS (FDUPVES_HASH_BITS_MAX)];
+  struct st_images images[1];
+  GThreadPool *thread_pool;
   find_step step[1];
+  gui_t *gui = (gui_t *)arg;
 
   count = 0;
 
-  hashs = g_new0 (hash_t, ptr->len);
+  bits = g_ini->hash_bits;
+  words = FDUPVES_HASH_WORDS (bits);
+  hashs = g_new0 (hash_t, ptr->len * words);
   g_return_val_if_fail (hashs, 0);
 
+  images->ptr = ptr;
+  images->bits = bits;
+  images->hashs = hashs;
+  images->done = 0;
+
+  thread_pool = g_thread_pool_new ((GFunc)image_hash_func, images,
+                                   fd_cpu_budget (), FALSE, NULL);
+  if (thread_pool == NULL)
+    {
+      g_free (hashs);
+      return -1;
+    }
+
   step->found = FALSE;
   step->total = ptr->len;
   step->doing = _ ("Generate image hash value");
   for (i = 0; i < ptr->len; ++i)
     {
-      hashs[i] = image_file_hash ((gchar *)g_ptr_array_index (ptr, i));
-      step->now = i;
+      /* index + 1, the pool does not take NULL */
+      g_thread_pool_push (thread_pool, GSIZE_TO_POINTER (i + 1), NULL);
+    }
+
+  /* workers store each hash at its own index, so the array keeps the input
+   * order, only the progress is read back here */
+  while ((guint)g_atomic_int_get (&images->done) < ptr->len && !gui->quit)
+    {
+      step->now = g_atomic_int_get (&images->done);
       cb (step, arg);
+      g_usleep (100 * 1000);
+    }
+
+  g_thread_pool_free (thread_pool, gui->quit, TRUE);
+
+  if (gui->quit)
+    {
+      g_free (hashs);
+      return 0;
     }
 
   step->doing = _ ("Compare image hash value");
   step->now = 0;
+  dist = find_hash_distance (g_ini->same_image_distance, bits);
+  hash_area_mask (g_ini->compare_area, bits, area);
+  count += find_stop_list (hashs, ptr->len, bits, dist,
+                           (const gchar **)ptr->pdata, FD_SAME_IMAGE, step,
+                           cb, arg);
+  step->found = FALSE;
   for (i = 0; i < ptr->len - 1; ++i)
     {
-      for (j = i + 1; j < ptr->len; ++j)
+      for (j = i + 1; (j = hash_bits_find (bits, hashs, j, ptr->len,
+                                           hashs + i * words, dist, area))
+                      < ptr->len;
+           ++j)
         {
-          dist = hash_cmp (hashs[i], hashs[j]);
-          if (dist < g_ini->same_image_distance)
-            {
-              step->afile = g_ptr_array_index (ptr, i);
-              step->bfile = g_ptr_array_index (ptr, j);
-              step->found = TRUE;
-              step->type = FD_SAME_IMAGE;
-              cb (step, arg);
-              ++count;
-            }
+          step->afile = g_ptr_array_index (ptr, i);
+          step->bfile = g_ptr_array_index (ptr, j);
+          step->found = TRUE;
+          step->type = FD_SAME_IMAGE;
+          cb (step, arg);
+          ++count;
         }
 
       step->now = i;
@@ -130,60 +526,139 @@ int
 find_videos (GPtrArray *ptr, find_step_cb cb, gpointer arg)
 {
   gsize i, j, g, group_cnt;
-  int dist, count;
+  int dist, count, bits, same, frames, shift, matched, na, nb, agot, bgot;
+  hash_t area[FDUPVES_HASH_WORDS (FDUPVES_HASH_BITS_MAX)], *asig, *bsig;
+  float *lengths, step_s;
   struct st_find find[1];
   struct st_file *afile, *bfile;
+  struct st_video *avideo, *bvideo;
   find_step step[1];
   gui_t *gui = (gui_t *)arg;
 
   count = 0;
 
+  step->found = FALSE;
+  lengths = find_probe (ptr, FD_VIDEO, step, cb, arg);
+  if (lengths == NULL && ptr->len > 0)
+    {
+      return gui->quit ? 0 : -1;
+    }
+
   for (i = 0; g_ini->video_timers[i][0]; ++i)
     {
       find->ptr[i] = g_ptr_array_new_with_free_func ((GFreeFunc)st_file_free);
     }
   group_cnt = i;
 
-  step->found = FALSE;
-  step->total = ptr->len;
-  step->now = 0;
   step->doing = _ ("Generate video screenshot hash value");
 
+  find->videos
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)st_video_free);
   find->step = step;
   find->type = FD_VIDEO;
   find->cb = cb;
   find->arg = arg;
-  g_ptr_array_foreach (ptr, (GFunc)find_video_prepare, find);
+  for (i = 0; i < ptr->len; ++i)
+    {
+      find_video_prepare (g_ptr_array_index (ptr, i), lengths[i], find);
+    }
+  g_free (lengths);
 
-  step->doing = _ ("Compare video screenshot hash value");
-  for (g = 0; g < group_cnt; ++g)
+  /* one task per file, covering the offsets of every group it is in; the
+   * longest files go first so none of them is left alone at the end */
+  g_ptr_array_sort (find->videos, (GCompareFunc)st_video_length_cmp);
+  find->thread_pool = g_thread_pool_new ((GFunc)video_hash_func, NULL,
+                                         fd_cpu_budget (), FALSE, NULL);
+  if (find->thread_pool == NULL)
     {
-      if (find->ptr[g]->len <= 0)
+      g_ptr_array_free (find->videos, TRUE);
+      for (g = 0; g < group_cnt; ++g)
         {
           g_ptr_array_free (find->ptr[g], TRUE);
-          continue;
         }
+      return -1;
+    }
+
+  fd_cpu_budget_queue (find->videos->len);
+  for (i = 0; i < find->videos->len; ++i)
+    {
+      g_thread_pool_push (find->thread_pool,
+                          g_ptr_array_index (find->videos, i), NULL);
+    }
 
-      find->thread_pool = g_thread_pool_new (
-          (GFunc)video_hash_func, find, g_ini->threads_count, FALSE, NULL);
-      if (find->thread_pool == NULL)
+  g_thread_pool_free (find->thread_pool, gui->quit, TRUE);
+  fd_cpu_budget_reset ();
+
+  if (gui->quit)
+    {
+      g_ptr_array_free (find->videos, TRUE);
+      for (g = 0; g < group_cnt; ++g)
         {
           g_ptr_array_free (find->ptr[g], TRUE);
-          continue;
         }
+      return 0;
+    }
 
-      for (i = 0; i < find->ptr[g]->len; ++i)
+  step->doing = _ ("Compare video screenshot hash value");
+  bits = g_ini->hash_bits;
+  same = find_hash_distance (g_ini->same_video_distance, bits);
+  hash_area_mask (g_ini->compare_area, bits, area);
+  asig = g_new (hash_t, 2 * MAX (g_ini->compare_count, 1)
+                            * FDUPVES_HASH_WORDS (bits));
+  bsig = g_new (hash_t, 2 * MAX (g_ini->compare_count, 1)
+                            * FDUPVES_HASH_WORDS (bits));
+  /* most of the frames over the whole files must match, an intro or outro
+   * they share is not enough; a signature belongs to the video rather than
+   * to a group, so each pair of videos sharing a group is compared once */
+  for (i = 0; i + 1 < find->videos->len; ++i)
+    {
+      avideo = g_ptr_array_index (find->videos, i);
+      for (j = i + 1; avideo->frames > 0 && j < find->videos->len; ++j)
         {
-          afile = g_ptr_array_index (find->ptr[g], i);
-          afile->offset = g_ini->video_timers[g][2];
-          g_thread_pool_push (find->thread_pool, afile, NULL);
+          bvideo = g_ptr_array_index (find->videos, j);
+          if (bvideo->frames <= 0 || !(avideo->groups & bvideo->groups))
+            {
+              continue;
+            }
+
+          step_s = MAX (avideo->signature_step, bvideo->signature_step);
+          na = find_signature_on_grid (avideo, step_s, bits, asig, &agot);
+          nb = find_signature_on_grid (bvideo, step_s, bits, bsig, &bgot);
+          /* another intro length moves every frame the same number of
+           * seconds */
+          frames = MIN (na, nb);
+          shift = MAX (frames / 8, 1);
+          matched = hash_bits_matches (bits, asig, bsig, frames, shift, same,
+                                       area);
+          if (matched * 2 > MAX (agot, bgot))
+            {
+              g_debug ("%s and %s, %d of %d frames %f seconds apart match",
+                       avideo->path, bvideo->path, matched, frames, step_s);
+              step->found = TRUE;
+              step->afile = avideo->path;
+              step->bfile = bvideo->path;
+              step->type = FD_SAME_VIDEO_FRAMES;
+              cb (step, arg);
+              ++count;
+            }
         }
 
-      g_thread_pool_free (find->thread_pool, FALSE, TRUE);
+      step->found = FALSE;
+      step->total = find->videos->len;
+      step->now = i;
+      cb (step, arg);
+    }
 
-      if (gui->quit)
-        return 0;
+  for (g = 0; g < group_cnt; ++g)
+    {
+      if (find->ptr[g]->len <= 0)
+        {
+          g_ptr_array_free (find->ptr[g], TRUE);
+          continue;
+        }
 
+      count += find_video_stop_list (find->ptr[g], bits, same, step, cb,
+                                     arg);
       for (i = 0; i < find->ptr[g]->len - 1; ++i)
         {
           for (j = i + 1; j < find->ptr[g]->len; ++j)
@@ -191,9 +666,19 @@ find_videos (GPtrArray *ptr, find_step_cb cb, gpointer arg)
               afile = g_ptr_array_index (find->ptr[g], i);
               bfile = g_ptr_array_index (find->ptr[g], j);
 
-              dist = hash_cmp (afile->head->hash, bfile->head->hash);
-              if (dist < g_ini->same_video_distance)
+              /* the signatures of these were compared above */
+              if (afile->video->frames > 0 && bfile->video->frames > 0)
+                {
+                  continue;
+                }
+
+              dist = hash_bits_distance (bits, afile->head->hash,
+                                         bfile->head->hash, area);
+              if (dist < same)
                 {
+                  g_debug ("%s at %f and %s at %f, head distance %d",
+                           afile->path, afile->head->seek, bfile->path,
+                           bfile->head->seek, dist);
                   step->found = TRUE;
                   step->afile = afile->path;
                   step->bfile = bfile->path;
@@ -203,9 +688,13 @@ find_videos (GPtrArray *ptr, find_step_cb cb, gpointer arg)
                   continue;
                 }
 
-              dist = hash_cmp (afile->tail->hash, bfile->tail->hash);
-              if (dist < g_ini->same_video_distance)
+              dist = hash_bits_distance (bits, afile->tail->hash,
+                                         bfile->tail->hash, area);
+              if (dist < same)
                 {
+                  g_debug ("%s at %f and %s at %f, tail distance %d",
+                           afile->path, afile->tail->seek, bfile->path,
+                           bfile->tail->seek, dist);
                   step->found = TRUE;
                   step->afile = afile->path;
                   step->bfile = bfile->path;
@@ -223,133 +712,188 @@ find_videos (GPtrArray *ptr, find_step_cb cb, gpointer arg)
 
       g_ptr_array_free (find->ptr[g], TRUE);
     }
+  g_ptr_array_free (find->videos, TRUE);
+  g_free (asig);
+  g_free (bsig);
 
   return count;
 }
 
-/* convert 0-9 distance to same peak count
- * num1, first peak count
- * num2, second peak count
- */
-static int
-distance_to_same_peak_count (gulong num1, gulong num2, int distance)
-{
-  int minnum, count;
-  int rate[] = { 100, 90, 80, 50, 20, 10, 5, 2, 1, 0 };
-
-  minnum = num1 < num2 ? (int)num1 : (int)num2;
-  count = minnum * rate[distance] / 100;
-
-  if (count == 0)
-    count = 1;
-
-  return count;
-}
-
+/* report each video that a shorter one was cut from: every video gets a
+ * hash about once per second from its keyframes, an index from the bands
+ * of those hashes to the frames they are in gives the frames near each
+ * frame of a clip without comparing every pair of videos, and a pair is
+ * reported when enough of those frames agree on where the clip starts */
 int
-find_audios (GPtrArray *ptr, find_step_cb cb, gpointer arg)
+find_video_clips (GPtrArray *ptr, find_step_cb cb, gpointer arg)
 {
-  gsize i, j, dist;
-  int count, peak_count;
-  float blen, llen;
-  struct st_find find[1];
-  struct st_file *afile, *bfile;
+  gsize i;
+  int count, bits;
+  float *lengths;
+  struct st_timelines timelines[1];
+  struct st_timeline *timeline;
+  GThreadPool *thread_pool;
+  GHashTable *index;
   find_step step[1];
   gui_t *gui = (gui_t *)arg;
-  static int rates[] = { 0, 1, 2, 10, 20, 100 };
 
   count = 0;
-  find->ptr[0] = g_ptr_array_new_with_free_func ((GFreeFunc)st_file_free);
   step->found = FALSE;
-  step->total = ptr->len;
-  step->now = 0;
-  step->doing = _ ("Generate audio screenshot hash value");
+  lengths = find_probe (ptr, FD_VIDEO, step, cb, arg);
+  if (lengths == NULL && ptr->len > 0)
+    {
+      return gui->quit ? 0 : -1;
+    }
 
-  find->thread_pool = g_thread_pool_new ((GFunc)audio_hashes_func, NULL,
-                                         g_ini->threads_count, FALSE, NULL);
-  if (find->thread_pool == NULL)
+  bits = g_ini->hash_bits;
+  timelines->ptr
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)st_timeline_free);
+  timelines->bits = bits;
+  timelines->done = 0;
+  for (i = 0; i < ptr->len; ++i)
     {
-      g_ptr_array_free (find->ptr[0], TRUE);
+      if (lengths[i] <= 0)
+        {
+          continue;
+        }
+      timeline = g_new0 (struct st_timeline, 1);
+      timeline->path = g_ptr_array_index (ptr, i);
+      timeline->length = lengths[i];
+      g_ptr_array_add (timelines->ptr, timeline);
+    }
+  g_free (lengths);
+
+  thread_pool = g_thread_pool_new ((GFunc)timeline_hash_func, timelines,
+                                   fd_cpu_budget (), FALSE, NULL);
+  if (thread_pool == NULL)
+    {
+      g_ptr_array_free (timelines->ptr, TRUE);
       return -1;
     }
 
-  find->step = step;
+  step->total = timelines->ptr->len;
+  step->now = 0;
+  step->doing = _ ("Generate video timeline hash value");
+  fd_cpu_budget_queue (timelines->ptr->len);
+  for (i = 0; i < timelines->ptr->len; ++i)
+    {
+      g_thread_pool_push (thread_pool, GSIZE_TO_POINTER (i + 1), NULL);
+    }
+
+  while ((guint)g_atomic_int_get (&timelines->done) < timelines->ptr->len
+         && !gui->quit)
+    {
+      step->now = g_atomic_int_get (&timelines->done);
+      cb (step, arg);
+      g_usleep (100 * 1000);
+    }
+
+  g_thread_pool_free (thread_pool, gui->quit, TRUE);
+  fd_cpu_budget_reset ();
+
+  if (gui->quit)
+    {
+      g_ptr_array_free (timelines->ptr, TRUE);
+      return 0;
+    }
+
+  step->doing = _ ("Compare video timeline hash value");
+  index = find_clip_index (timelines->ptr, bits);
+  for (i = 0; i < timelines->ptr->len && !gui->quit; ++i)
+    {
+      count += find_clip_matches (timelines->ptr, index, i, bits, step, cb,
+                                  arg);
+
+      step->found = FALSE;
+      step->now = i;
+      cb (step, arg);
+    }
+  g_hash_table_destroy (index);
+  g_ptr_array_free (timelines->ptr, TRUE);
+
+  return count;
+}
+
+/* convert 0-9 distance to same peak count
+ * num1, first peak count
+ * num2, second peak count
+ */
+static int
+distance_to_same_peak_count (gulong num1, gulong num2, int distance)
+{
+  int minnum, count;
+  int rate[] = { 100, 90, 80, 50, 20, 10, 5, 2, 1, 0 };
+
+  minnum = num1 < num2 ? (int)num1 : (int)num2;
+  count = minnum * rate[distance] / 100;
+
+  if (count == 0)
+    count = 1;
+
+  return count;
+}
+
+int
+find_audios (GPtrArray *ptr, find_step_cb cb, gpointer arg)
+{
+  guint i, *counts, *seen;
+  int count;
+  struct st_find find[1];
+  GHashTable *index;
+  GArray *touched;
+  find_step step[1];
+  gui_t *gui = (gui_t *)arg;
+
+  count = 0;
+  step->found = FALSE;
+
+  /* no probe stage, each file is opened once by its hashing, which gives
+   * its length too */
+  find->ptr[0] = g_ptr_array_new_with_free_func ((GFreeFunc)st_file_free);
+  step->doing = _ ("Generate audio screenshot hash value");
+
+  find->thread_pool = g_thread_pool_new ((GFunc)audio_hashes_func, NULL,
+                                         fd_cpu_budget (), FALSE, NULL);
+  if (find->thread_pool == NULL)
+    {
+      g_ptr_array_free (find->ptr[0], TRUE);
+      return -1;
+    }
+
+  find->step = step;
   find->type = FIND_AUDIO;
   find->cb = cb;
   find->arg = arg;
-  g_ptr_array_foreach (ptr, (GFunc)find_audio_prepare, find);
+  for (i = 0; i < ptr->len; ++i)
+    {
+      find_audio_prepare (g_ptr_array_index (ptr, i), find);
+    }
 
   g_thread_pool_free (find->thread_pool, FALSE, TRUE);
+  fd_cpu_budget_reset ();
 
   if (gui->quit)
     return 0;
 
   step->doing = _ ("Compare audio hash value");
-  for (i = 0; i < find->ptr[0]->len - 1; ++i)
+  index = find_audio_index (find->ptr[0]);
+  counts = g_new0 (guint, find->ptr[0]->len);
+  seen = g_new0 (guint, find->ptr[0]->len);
+  touched = g_array_new (FALSE, FALSE, sizeof (guint));
+  for (i = 0; i < find->ptr[0]->len && !gui->quit; ++i)
     {
-      afile = g_ptr_array_index (find->ptr[0], i);
-
-      if (hash_array_size (afile->hashArray) == 0)
-        {
-          continue;
-        }
-
-      for (j = i + 1; j < find->ptr[0]->len; ++j)
-        {
-          bfile = g_ptr_array_index (find->ptr[0], j);
-
-          if (hash_array_size (bfile->hashArray) == 0)
-            {
-              continue;
-            }
-
-          if (g_ini->filter_time_rate != 0)
-            {
-              blen = afile->length;
-              llen = bfile->length;
-              if (blen < llen)
-                {
-                  llen = afile->length;
-                  blen = bfile->length;
-                }
-              if (llen * (float)(rates[g_ini->filter_time_rate] + 1) < blen)
-                {
-                  g_debug ("%s length %f and %s lenght %f, filtered",
-                           afile->path, afile->length, bfile->path,
-                           bfile->length);
-                  continue;
-                }
-            }
-
-          dist = audio_fingerprint_similarity (afile->hashArray,
-                                               bfile->hashArray);
-          if (dist == 0)
-            continue;
-
-          peak_count = distance_to_same_peak_count (
-              hash_array_size (afile->hashArray),
-              hash_array_size (bfile->hashArray), g_ini->same_audio_distance);
-          g_debug ("distance: %d, peaks %lu and %lu, need %d, dist: %lu",
-                   g_ini->same_audio_distance,
-                   hash_array_size (afile->hashArray),
-                   hash_array_size (bfile->hashArray), peak_count, dist);
-          if (dist >= peak_count)
-            {
-              step->found = TRUE;
-              step->afile = afile->path;
-              step->bfile = bfile->path;
-              step->type = FD_SAME_AUDIO_HEAD;
-              cb (step, arg);
-              ++count;
-              continue;
-            }
-        }
+      count += find_audio_matches (find->ptr[0], index, i, counts, seen,
+                                   touched, step, cb, arg);
 
       step->found = FALSE;
       step->total = find->ptr[0]->len;
       step->now = i;
       cb (step, arg);
     }
+  g_array_free (touched, TRUE);
+  g_free (seen);
+  g_free (counts);
+  g_hash_table_destroy (index);
 
   g_ptr_array_free (find->ptr[0], TRUE);
 
@@ -416,18 +960,493 @@ st_file_free (struct st_file *file)
 }
 
 static void
-find_video_prepare (const gchar *file, struct st_find *find)
+st_video_free (struct st_video *video)
+{
+  g_free (video->signature);
+  g_free (video);
+}
+
+static void
+st_timeline_free (struct st_timeline *timeline)
+{
+  g_free (timeline->times);
+  g_free (timeline->hashes);
+  g_free (timeline);
+}
+
+/* bands per hash word */
+static int
+find_clip_bands (void)
+{
+  return CLAMP (g_ini->same_video_distance, FD_CLIP_BANDS_MIN,
+                FD_CLIP_BANDS_MAX);
+}
+
+/* band of hash h, of bands per word, with its number as the index key */
+static guint
+find_clip_band (const hash_t *h, int band, int bands)
+{
+  int lo, hi;
+
+  lo = band % bands * 64 / bands;
+  hi = (band % bands + 1) * 64 / bands;
+
+  return ((guint)band << 16)
+         | (guint)((h[band / bands] >> lo) & ((1ULL << (hi - lo)) - 1));
+}
+
+/* a band value more frames have than the stop list allows */
+static gboolean
+find_clip_band_common (gpointer key, GArray *postings, gpointer limit)
+{
+  return postings->len > GPOINTER_TO_UINT (limit);
+}
+
+/* from each band value of the hashes to the frames having it, as
+ * video << 32 | frame; near uniform frames, fades and black ones in about
+ * every video, are left out, and so are band values shared by more frames
+ * than find_stop_list would let a hash value be, lest a lookup walk a
+ * share of all the frames */
+static GHashTable *
+find_clip_index (GPtrArray *ptr, int bits)
+{
+  GHashTable *index;
+  GArray *postings;
+  struct st_timeline *timeline;
+  const hash_t *h;
+  guint64 posting;
+  guint v, n;
+  int e, b, words, bands;
+  gpointer key;
+
+  words = FDUPVES_HASH_WORDS (bits);
+  bands = find_clip_bands ();
+  index = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                 (GDestroyNotify)g_array_unref);
+  n = 0;
+  for (v = 0; v < ptr->len; ++v)
+    {
+      timeline = g_ptr_array_index (ptr, v);
+      for (e = 0; e < timeline->count; ++e)
+        {
+          h = timeline->hashes + e * words;
+          if (hash_bits_is_zero (bits, h) || find_hash_flat (h, bits))
+            {
+              continue;
+            }
+
+          ++n;
+          posting = ((guint64)v << 32) | (guint)e;
+          for (b = 0; b < words * bands; ++b)
+            {
+              key = GUINT_TO_POINTER (find_clip_band (h, b, bands));
+              postings = g_hash_table_lookup (index, key);
+              if (postings == NULL)
+                {
+                  postings = g_array_new (FALSE, FALSE, sizeof (guint64));
+                  g_hash_table_insert (index, key, postings);
+                }
+              g_array_append_val (postings, posting);
+            }
+        }
+    }
+
+  g_hash_table_foreach_remove (
+      index, (GHRFunc)find_clip_band_common,
+      GUINT_TO_POINTER (MAX (FD_STOP_LIST_MIN, n / FD_STOP_LIST_SHARE)));
+
+  return index;
+}
+
+/* whether hashes h and vh share a band before band, so the frame was
+ * already found through that one */
+static gboolean
+find_clip_band_seen (const hash_t *h, const hash_t *vh, int band, int bands)
+{
+  int b;
+
+  for (b = 0; b < band; ++b)
+    {
+      if (find_clip_band (h, b, bands) == find_clip_band (vh, b, bands))
+        {
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+static int
+clip_vote_cmp (const struct st_clip_vote *a, const struct st_clip_vote *b)
+{
+  if (a->video != b->video)
+    {
+      return a->video < b->video ? -1 : 1;
+    }
+  if (a->offset != b->offset)
+    {
+      return a->offset < b->offset ? -1 : 1;
+    }
+  return (a->entry > b->entry) - (a->entry < b->entry);
+}
+
+/* report the longer videos clip a was cut from: each frame of the clip
+ * votes, for every near frame the index gives, for the second the clip
+ * would start at in that video; a video wins when half of the frames of
+ * the clip agree on a start within a second */
+static int
+find_clip_matches (GPtrArray *ptr, GHashTable *index, guint a, int bits,
+                   find_step *step, find_step_cb cb, gpointer arg)
+{
+  struct st_timeline *clip, *video;
+  struct st_clip_vote vote, *votes;
+  GArray *postings, *voted;
+  const hash_t *h, *vh;
+  hash_t area[FDUPVES_HASH_WORDS (FDUPVES_HASH_BITS_MAX)];
+  guint64 posting;
+  guint i, j, k, v, n, last, window, *stamps;
+  int e, b, words, bands, same, frames, need, run, best, count;
+
+  clip = g_ptr_array_index (ptr, a);
+  words = FDUPVES_HASH_WORDS (bits);
+  bands = find_clip_bands ();
+  same = find_hash_distance (g_ini->same_video_distance, bits);
+  hash_area_mask (g_ini->compare_area, bits, area);
+
+  voted = g_array_new (FALSE, FALSE, sizeof (struct st_clip_vote));
+  frames = 0;
+  for (e = 0; e < clip->count; ++e)
+    {
+      h = clip->hashes + e * words;
+      if (hash_bits_is_zero (bits, h) || find_hash_flat (h, bits))
+        {
+          continue;
+        }
+      ++frames;
+
+      for (b = 0; b < words * bands; ++b)
+        {
+          postings = g_hash_table_lookup (
+              index, GUINT_TO_POINTER (find_clip_band (h, b, bands)));
+          for (i = 0; postings && i < postings->len; ++i)
+            {
+              posting = g_array_index (postings, guint64, i);
+              v = (guint)(posting >> 32);
+              video = g_ptr_array_index (ptr, v);
+              /* only into longer videos, each pair of equal length once */
+              if (v == a || video->length < clip->length
+                  || (video->length == clip->length && v < a))
+                {
+                  continue;
+                }
+
+              /* a frame found through several bands votes once, at the
+               * first of them */
+              vh = video->hashes + (posting & 0xffffffff) * words;
+              if (find_clip_band_seen (h, vh, b, bands)
+                  || hash_bits_distance (bits, h, vh, area) >= same)
+                {
+                  continue;
+                }
+
+              vote.video = v;
+              vote.offset = (gint)lrintf (
+                  video->times[posting & 0xffffffff] - clip->times[e]);
+              vote.entry = e;
+              g_array_append_val (voted, vote);
+            }
+        }
+    }
+
+  g_array_sort (voted, (GCompareFunc)clip_vote_cmp);
+  votes = (struct st_clip_vote *)voted->data;
+  n = voted->len;
+
+  /* the frames of the clip counted in the window being counted */
+  stamps = g_new0 (guint, clip->count);
+  window = 0;
+  need = MAX (3, frames / 2);
+  count = 0;
+  for (i = 0; i < n; i = j)
+    {
+      /* the votes of one video, by offset */
+      for (j = i; j < n && votes[j].video == votes[i].video; ++j)
+        ;
+
+      best = 0;
+      for (k = i, last = i; k < j; ++k)
+        {
+          while (votes[last].offset < votes[k].offset - 1)
+            {
+              ++last;
+            }
+          /* a frame of the clip near frames a second apart in the video
+           * votes for both offsets, it counts once */
+          ++window;
+          run = 0;
+          for (v = last; v < j && votes[v].offset <= votes[k].offset + 1; ++v)
+            {
+              if (stamps[votes[v].entry] != window)
+                {
+                  stamps[votes[v].entry] = window;
+                  ++run;
+                }
+            }
+          best = MAX (best, run);
+        }
+
+      if (best >= need)
+        {
+          video = g_ptr_array_index (ptr, votes[i].video);
+          g_debug ("%s is in %s, %d of %d frames match", clip->path,
+                   video->path, best, frames);
+          step->found = TRUE;
+          step->afile = clip->path;
+          step->bfile = video->path;
+          step->type = FD_SAME_VIDEO_HEAD;
+          cb (step, arg);
+          ++count;
+        }
+    }
+  g_array_free (voted, TRUE);
+  g_free (stamps);
+
+  return count;
+}
+
+static gsize
+find_audio_size (const struct st_file *file)
+{
+  return file->hashArray ? hash_array_size (file->hashArray) : 0;
+}
+
+/* a landmark in more files than the stop list allows, its postings are
+ * in file order */
+static gboolean
+find_audio_landmark_common (gpointer key, GArray *postings, gpointer limit)
+{
+  guint i, files, f, last;
+
+  for (files = 0, last = 0, i = 0; i < postings->len; ++i)
+    {
+      f = (guint)(g_array_index (postings, guint64, i) >> 32);
+      if (i == 0 || f != last)
+        {
+          last = f;
+          if (++files > GPOINTER_TO_UINT (limit))
+            {
+              return TRUE;
+            }
+        }
+    }
+
+  return FALSE;
+}
+
+/* from each landmark to the files having it, as file << 32 | offset;
+ * landmarks in more files than find_stop_list would let a hash value be,
+ * silence and hum about every file has, are left out lest each lookup
+ * walk a share of all the landmarks */
+static GHashTable *
+find_audio_index (GPtrArray *ptr)
+{
+  GHashTable *index;
+  GArray *postings;
+  struct st_file *file;
+  audio_peak_hash *peak;
+  guint64 posting;
+  guint f, e;
+
+  index = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                 (GDestroyNotify)g_array_unref);
+  for (f = 0; f < ptr->len; ++f)
+    {
+      file = g_ptr_array_index (ptr, f);
+      for (e = 0; e < find_audio_size (file); ++e)
+        {
+          peak = hash_array_index (file->hashArray, e);
+          posting = ((guint64)f << 32) | (guint32)peak->offset;
+          postings = g_hash_table_lookup (index, GUINT_TO_POINTER (peak->hash));
+          if (postings == NULL)
+            {
+              postings = g_array_new (FALSE, FALSE, sizeof (guint64));
+              g_hash_table_insert (index, GUINT_TO_POINTER (peak->hash),
+                                   postings);
+            }
+          g_array_append_val (postings, posting);
+        }
+    }
+
+  g_hash_table_foreach_remove (
+      index, (GHRFunc)find_audio_landmark_common,
+      GUINT_TO_POINTER (MAX (FD_STOP_LIST_MIN,
+                             ptr->len / FD_STOP_LIST_SHARE)));
+
+  return index;
+}
+
+/* report the later files sounding like file a: its landmarks are looked
+ * up in the index and each one found in a file counts once for it, the
+ * files with enough of them are then scored on the landmarks found at one
+ * time shift by audio_fingerprint_similarity.  The landmarks the index
+ * stop-listed may be in any file, they count for each one there.  counts
+ * and seen have an entry per file and are left zeroed, touched lists the
+ * files counted so only those are checked and cleared */
+static int
+find_audio_matches (GPtrArray *ptr, GHashTable *index, guint a,
+                    guint *counts, guint *seen, GArray *touched,
+                    find_step *step, find_step_cb cb, gpointer arg)
+{
+  struct st_file *afile, *bfile;
+  audio_peak_hash *peak;
+  GArray *postings;
+  guint e, i, b, dist, stopped;
+  int count, peak_count;
+  float blen, llen;
+  static int rates[] = { 0, 1, 2, 10, 20, 100 };
+
+  afile = g_ptr_array_index (ptr, a);
+  stopped = 0;
+  for (e = 0; e < find_audio_size (afile); ++e)
+    {
+      peak = hash_array_index (afile->hashArray, e);
+      postings = g_hash_table_lookup (index, GUINT_TO_POINTER (peak->hash));
+      if (postings == NULL)
+        {
+          ++stopped;
+          continue;
+        }
+      for (i = 0; i < postings->len; ++i)
+        {
+          b = (guint)(g_array_index (postings, guint64, i) >> 32);
+          if (b <= a || seen[b] == e + 1)
+            {
+              continue;
+            }
+          seen[b] = e + 1;
+          if (counts[b]++ == 0)
+            {
+              g_array_append_val (touched, b);
+            }
+        }
+    }
+
+  count = 0;
+  for (i = 0; i < touched->len; ++i)
+    {
+      b = g_array_index (touched, guint, i);
+      bfile = g_ptr_array_index (ptr, b);
+      dist = counts[b];
+      counts[b] = 0;
+      seen[b] = 0;
+
+      if (g_ini->filter_time_rate != 0)
+        {
+          blen = MAX (afile->length, bfile->length);
+          llen = MIN (afile->length, bfile->length);
+          if (llen * (float)(rates[g_ini->filter_time_rate] + 1) < blen)
+            {
+              g_debug ("%s length %f and %s lenght %f, filtered", afile->path,
+                       afile->length, bfile->path, bfile->length);
+              continue;
+            }
+        }
+
+      peak_count = distance_to_same_peak_count (find_audio_size (afile),
+                                                find_audio_size (bfile),
+                                                g_ini->same_audio_distance);
+      /* the landmarks shared at any shift bound the aligned ones */
+      if ((int)(dist + stopped) < peak_count)
+        {
+          continue;
+        }
+
+      dist = audio_fingerprint_similarity (afile->hashArray, bfile->hashArray,
+                                           peak_count);
+      g_debug ("distance: %d, peaks %lu and %lu, need %d, dist: %u",
+               g_ini->same_audio_distance, find_audio_size (afile),
+               find_audio_size (bfile), peak_count, dist);
+      if ((int)dist >= peak_count)
+        {
+          step->found = TRUE;
+          step->afile = afile->path;
+          step->bfile = bfile->path;
+          step->type = FD_SAME_AUDIO_HEAD;
+          cb (step, arg);
+          ++count;
+        }
+    }
+  g_array_set_size (touched, 0);
+
+  return count;
+}
+
+/* the duration of every file in ptr, probed on the worker pool; the
+ * containers are only opened for files the cache has no probe of;
+ * NULL when cancelled */
+static float *
+find_probe (GPtrArray *ptr, int type, find_step *step, find_step_cb cb,
+            gpointer arg)
+{
+  gsize i;
+  struct st_probe probe[1];
+  GThreadPool *thread_pool;
+  gui_t *gui = (gui_t *)arg;
+
+  probe->ptr = ptr;
+  probe->type = type;
+  probe->lengths = g_new0 (float, ptr->len);
+  probe->done = 0;
+
+  thread_pool = g_thread_pool_new ((GFunc)probe_func, probe, fd_cpu_budget (),
+                                   FALSE, NULL);
+  if (thread_pool == NULL)
+    {
+      g_free (probe->lengths);
+      return NULL;
+    }
+
+  step->total = ptr->len;
+  step->now = 0;
+  step->doing = _ ("Probe media files");
+  for (i = 0; i < ptr->len; ++i)
+    {
+      g_thread_pool_push (thread_pool, GSIZE_TO_POINTER (i + 1), NULL);
+    }
+
+  while ((guint)g_atomic_int_get (&probe->done) < ptr->len && !gui->quit)
+    {
+      step->now = g_atomic_int_get (&probe->done);
+      cb (step, arg);
+      g_usleep (100 * 1000);
+    }
+
+  g_thread_pool_free (thread_pool, gui->quit, TRUE);
+  step->now = ptr->len;
+
+  if (gui->quit)
+    {
+      g_free (probe->lengths);
+      return NULL;
+    }
+
+  return probe->lengths;
+}
+
+static void
+find_video_prepare (const gchar *file, float length, struct st_find *find)
 {
-  int i, length;
+  int i;
   struct st_file *stv;
+  struct st_video *video;
 
-  length = video_get_length (file);
   if (length <= 0)
     {
       g_warning ("Can't get duration of %s", file);
       return;
     }
 
+  video = NULL;
   for (i = 0; g_ini->video_timers[i][0]; ++i)
     {
       if (length < g_ini->video_timers[i][0]
@@ -440,52 +1459,173 @@ find_video_prepare (const gchar *file, struct st_find *find)
 
       stv->path = file;
       stv->length = length;
+      stv->offset = g_ini->video_timers[i][2];
 
       g_ptr_array_add (find->ptr[i], stv);
-    }
 
-  ++find->step->now;
-  find->cb (find->step, find->arg);
+      if (video == NULL)
+        {
+          video = g_malloc0 (sizeof (struct st_video));
+          video->path = file;
+          g_ptr_array_add (find->videos, video);
+        }
+      video->files[video->count++] = stv;
+      video->groups |= 1u << i;
+      stv->video = video;
+    }
 }
 
 static void
 find_audio_prepare (const gchar *file, struct st_find *find)
 {
-  float length;
   struct st_file *stv;
 
-  length = audio_get_length (file);
-  if (length <= 0.1f)
-    {
-      g_warning ("Can't get duration of %s", file);
-      return;
-    }
-
   stv = g_malloc0 (sizeof (struct st_file));
 
   stv->path = file;
-  stv->length = length;
   stv->hashArray = NULL;
 
+  fd_cpu_budget_queue (1);
   g_thread_pool_push (find->thread_pool, stv, NULL);
 
   g_ptr_array_add (find->ptr[0], stv);
+}
 
-  ++find->step->now;
-  find->cb (find->step, find->arg);
+static void
+timeline_hash_func (gpointer index, struct st_timelines *timelines)
+{
+  struct st_timeline *timeline;
+
+  timeline = g_ptr_array_index (timelines->ptr, GPOINTER_TO_SIZE (index) - 1);
+  fd_cpu_budget_enter ();
+  timeline->count = video_timeline_hashes (
+      timeline->path, timeline->length, timelines->bits, g_ini->hash_alg,
+      &timeline->times, &timeline->hashes);
+  fd_cpu_budget_leave ();
+  g_atomic_int_inc (&timelines->done);
 }
 
-static int
-video_hash_func (struct st_file *file)
+static void
+probe_func (gpointer index, struct st_probe *probe)
 {
-  file->head->hash = video_time_hash (file->path, file->offset);
-  file->tail->hash = video_time_hash (file->path, file->length - file->offset);
-  return 0;
+  gsize i;
+  const gchar *file;
+
+  i = GPOINTER_TO_SIZE (index) - 1;
+  file = g_ptr_array_index (probe->ptr, i);
+  if (probe->type == FD_VIDEO)
+    {
+      probe->lengths[i] = video_get_length (file);
+    }
+  else
+    {
+      probe->lengths[i] = audio_get_length (file);
+    }
+  g_atomic_int_inc (&probe->done);
+}
+
+static void
+image_hash_func (gpointer index, struct st_images *images)
+{
+  gsize i;
+  int words;
+  hash_t hashes[FDUPVES_HASH_ALGS_CNT
+                * FDUPVES_HASH_WORDS (FDUPVES_HASH_BITS_MAX)];
+
+  i = GPOINTER_TO_SIZE (index) - 1;
+  words = FDUPVES_HASH_WORDS (images->bits);
+  image_file_hashes ((gchar *)g_ptr_array_index (images->ptr, i),
+                     images->bits, FDUPVES_IMAGE_HASH_MASKS, hashes);
+  memcpy (images->hashs + i * words, hashes + g_ini->hash_alg * words,
+          sizeof (hash_t) * words);
+  g_atomic_int_inc (&images->done);
+}
+
+static void
+video_hash_func (struct st_video *video, gpointer unused)
+{
+  int i, n, bits, words, size;
+  float offsets[0x20], sampled[0x20];
+  int got[0x20];
+  hash_t *hashes, *h;
+
+  bits = g_ini->hash_bits;
+  words = FDUPVES_HASH_WORDS (bits);
+  size = FDUPVES_HASH_ALGS_CNT * words;
+
+  /* head and tail of each group entry */
+  for (i = 0, n = 0; i < video->count; ++i)
+    {
+      offsets[n++] = video->files[i]->offset;
+      offsets[n++] = video->files[i]->length - video->files[i]->offset;
+    }
+
+  fd_cpu_budget_enter ();
+  if (g_ini->compare_count > 1)
+    {
+      /* the grid leaves between compare_count and twice that frames */
+      i = 2 * g_ini->compare_count;
+      video->signature = g_new (hash_t, i * words);
+      video->frames = video_signature (video->path, video->files[0]->length,
+                                       i, bits, g_ini->hash_alg,
+                                       video->signature);
+      video->signature_count = video_signature_grid (
+          video->files[0]->length, i, &video->signature_step);
+      for (i = 0; i < video->signature_count; ++i)
+        {
+          h = video->signature + i * words;
+          if (!hash_bits_is_zero (bits, h)
+              && find_hash_flat (h, bits))
+            {
+              memset (h, 0, sizeof (hash_t) * words);
+              --video->frames;
+            }
+        }
+    }
+
+  /* the signature stands in for head and tail in the compare, they are
+   * only decoded when it got nothing */
+  if (video->frames > 0)
+    {
+      fd_cpu_budget_leave ();
+      return;
+    }
+
+  hashes = g_new (hash_t, size * n);
+  video_times_hashes (video->path, offsets, n, bits, FDUPVES_IMAGE_HASH_MASKS,
+                      hashes, got, sampled);
+  fd_cpu_budget_leave ();
+
+  for (i = 0; i < video->count; ++i)
+    {
+      memcpy (video->files[i]->head->hash,
+              hashes + (2 * i) * size + g_ini->hash_alg * words,
+              sizeof (hash_t) * words);
+      memcpy (video->files[i]->tail->hash,
+              hashes + (2 * i + 1) * size + g_ini->hash_alg * words,
+              sizeof (hash_t) * words);
+      video->files[i]->head->seek = sampled[2 * i];
+      video->files[i]->tail->seek = sampled[2 * i + 1];
+    }
+
+  g_free (hashes);
 }
 
 static int
 audio_hashes_func (struct st_file *file)
 {
+  fd_cpu_budget_enter ();
   file->hashArray = audio_hashes (file->path);
+  /* cached by the decode when it had to run */
+  file->length = audio_get_length (file->path);
+  fd_cpu_budget_leave ();
+
+  if (file->length <= 0.1f && file->hashArray)
+    {
+      g_warning ("Can't get duration of %s", file->path);
+      hash_array_free (file->hashArray);
+      file->hashArray = NULL;
+    }
+
   return 0;
 }
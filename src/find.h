@@ -36,7 +36,8 @@ typedef enum
   FD_COMPARE_BOTTOM,
   FD_COMPARE_LEFT,
   FD_COMPARE_RIGHT,
-  FD_COMPARE_AUDIO_IN_VIDEO
+  FD_COMPARE_AUDIO_IN_VIDEO,
+  FD_COMPARE_VIDEO_CLIP
 } compare_type;
 
 typedef enum
@@ -62,6 +63,8 @@ typedef enum
   FD_SAME_IMAGE,
   FD_SAME_VIDEO_HEAD,
   FD_SAME_VIDEO_TAIL,
+  /* most frames over the whole files */
+  FD_SAME_VIDEO_FRAMES,
   FD_SAME_AUDIO_HEAD,
   FD_SAME_AUDIO_TAIL,
   FD_SAME_EBOOK,
@@ -84,6 +87,8 @@ int find_images (GPtrArray *, find_step_cb, gpointer);
 
 int find_videos (GPtrArray *, find_step_cb, gpointer);
 
+int find_video_clips (GPtrArray *, find_step_cb, gpointer);
+
 int find_audios (GPtrArray *, find_step_cb, gpointer);
 
 int find_ebooks (GPtrArray *, find_step_cb, gpointer);
@@ -612,6 +612,9 @@ find_attr_new (gui_t *gui)
   gtk_combo_box_text_insert_text (GTK_COMBO_BOX_TEXT (comparearea),
                                   FD_COMPARE_AUDIO_IN_VIDEO,
                                   _ ("compare audio in video"));
+  gtk_combo_box_text_insert_text (GTK_COMBO_BOX_TEXT (comparearea),
+                                  FD_COMPARE_VIDEO_CLIP,
+                                  _ ("find clips cut from videos"));
   g_signal_connect (G_OBJECT (comparearea), "changed",
                     G_CALLBACK (gui_compareareacb), gui);
   gtk_combo_box_set_active (GTK_COMBO_BOX (comparearea), g_ini->compare_area);
@@ -915,6 +918,11 @@ gui_find_thread_func (gui_t *gui)
         {
           find_audios (gui->videos, (find_step_cb)gui_find_step_cb, gui);
         }
+      else if (g_ini->compare_area == FD_COMPARE_VIDEO_CLIP)
+        {
+          find_video_clips (gui->videos, (find_step_cb)gui_find_step_cb,
+                            gui);
+        }
       else
         {
           find_videos (gui->videos, (find_step_cb)gui_find_step_cb, gui);
@@ -2283,7 +2291,8 @@ gui_append_same_slist (gui_t *gui, GSList *slist, const gchar *afile,
   int filetype;
 
   filetype = FD_IMAGE;
-  if (type == FD_SAME_VIDEO_HEAD || type == FD_SAME_VIDEO_TAIL)
+  if (type == FD_SAME_VIDEO_HEAD || type == FD_SAME_VIDEO_TAIL
+      || type == FD_SAME_VIDEO_FRAMES)
     {
       filetype = FD_VIDEO;
     }
@@ -35,53 +35,77 @@
 
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #include <glib.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 const char *hash_phrase[] = {
   "image_hash",
   "image_phash",
   "audio_hash",
+  "image_dhash",
 };
 
 static hash_t pixbuf_hash (GdkPixbuf *);
 
+static void luma_hashes (const guchar *, int, int, hash_t *);
+
+static void gray_hash_bits (const unsigned char *, int, hash_t *);
+
+static void gray_dhash_bits (const unsigned char *, int, int, hash_t *);
+
 #define FDUPVES_HASH_LEN 8
 
-hash_t
-image_file_hash (const char *file)
+/* luma variance under which a frame is too flat to hash, a standard
+ * deviation of 8 levels */
+#define FDUPVES_LUMA_FLAT_VARIANCE 64
+
+/* seconds past a flat frame to look for one worth hashing */
+#define FDUPVES_VIDEO_FLAT_WINDOW 10
+
+/* decode the file once and compute every hash in mask from the same gray
+ * grid, each hash is bits wide and hashes holds FDUPVES_HASH_WORDS (bits)
+ * words per enum hash_type, return the mask got */
+int
+image_file_hashes (const char *file, int bits, int mask, hash_t *hashes)
 {
-  GdkPixbuf *buf;
-  hash_t h;
-  GError *err;
+  guchar luma[FDUPVES_LUMA_LEN * FDUPVES_LUMA_LEN];
+  int got, version;
+
+  g_return_val_if_fail (hash_bits_valid (bits), 0);
+
+  version = g_ini->image_thumbnail ? FDUPVES_IMAGE_THUMB_HASH_VERSION
+                                   : FDUPVES_IMAGE_HASH_VERSION;
 
+  memset (hashes, 0,
+          sizeof (hash_t) * FDUPVES_HASH_ALGS_CNT * FDUPVES_HASH_WORDS (bits));
+
+  got = 0;
   if (g_cache)
     {
-      if (cache_get (g_cache, file, 0, FDUPVES_IMAGE_HASH, &h))
+      got = cache_get_hashes (g_cache, file, 0, version, bits, mask, hashes,
+                              NULL);
+      if (got == mask)
         {
-          return h;
+          return got;
         }
     }
 
-  buf = fdupves_gdkpixbuf_load_file_at_size (file, FDUPVES_HASH_LEN,
-                                             FDUPVES_HASH_LEN, &err);
-  if (err)
+  if (!fdupves_image_load_luma (file, FDUPVES_LUMA_LEN, FDUPVES_LUMA_LEN,
+                                luma))
     {
-      g_warning ("Load file: %s to pixbuf failed: %s", file, err->message);
-      g_error_free (err);
-      return 0;
+      return got;
     }
 
-  h = pixbuf_hash (buf);
-  g_object_unref (buf);
+  luma_hashes (luma, bits, mask & ~got, hashes);
 
   if (g_cache)
     {
-      if (h)
-        {
-          cache_set (g_cache, file, 0, FDUPVES_IMAGE_HASH, h);
-        }
+      cache_set_hashes (g_cache, file, 0, version, bits, mask & ~got, hashes,
+                        0);
     }
 
-  return h;
+  return mask;
 }
 
 hash_t
@@ -112,8 +136,8 @@ static hash_t
 pixbuf_hash (GdkPixbuf *pixbuf)
 {
   int width, height, rowstride, n_channels;
-  guchar *pixels, *p;
-  int *grays, sum, avg, x, y, off;
+  guchar *pixels, *p, *grays;
+  int x, y, off;
   hash_t hash;
 
   n_channels = gdk_pixbuf_get_n_channels (pixbuf);
@@ -127,7 +151,7 @@ pixbuf_hash (GdkPixbuf *pixbuf)
   rowstride = gdk_pixbuf_get_rowstride (pixbuf);
   pixels = gdk_pixbuf_get_pixels (pixbuf);
 
-  grays = g_new0 (int, width *height);
+  grays = g_new0 (guchar, width *height);
   off = 0;
   for (y = 0; y < height; ++y)
     {
@@ -139,115 +163,586 @@ pixbuf_hash (GdkPixbuf *pixbuf)
         }
     }
 
+  hash = gray_hash (grays, off);
+
+  g_free (grays);
+
+  return hash;
+}
+
+/* the w columns by h rows grid an aHash or dHash of bits is made from */
+static void
+hash_grid (int bits, int *w, int *h)
+{
+  *w = bits > FDUPVES_HASH_BITS ? 2 * FDUPVES_HASH_LEN : FDUPVES_HASH_LEN;
+  *h = bits / *w;
+}
+
+static void
+luma_hashes (const guchar *luma, int bits, int mask, hash_t *hashes)
+{
+  guchar grid[(2 * FDUPVES_HASH_LEN + 1) * 2 * FDUPVES_HASH_LEN];
+  int w, h, words;
+
+  hash_grid (bits, &w, &h);
+  words = FDUPVES_HASH_WORDS (bits);
+
+  if (mask & FDUPVES_HASH_MASK (FDUPVES_IMAGE_HASH))
+    {
+      fdupves_luma_scale (luma, FDUPVES_LUMA_LEN, FDUPVES_LUMA_LEN,
+                          FDUPVES_LUMA_LEN, grid, w, h);
+      gray_hash_bits (grid, w * h, hashes + FDUPVES_IMAGE_HASH * words);
+    }
+
+  if (mask & FDUPVES_HASH_MASK (FDUPVES_IMAGE_PHASH))
+    {
+      gray_phash_bits (luma, w, h, hashes + FDUPVES_IMAGE_PHASH * words);
+    }
+
+  if (mask & FDUPVES_HASH_MASK (FDUPVES_IMAGE_DHASH))
+    {
+      fdupves_luma_scale (luma, FDUPVES_LUMA_LEN, FDUPVES_LUMA_LEN,
+                          FDUPVES_LUMA_LEN, grid, w + 1, h);
+      gray_dhash_bits (grid, w, h, hashes + FDUPVES_IMAGE_DHASH * words);
+    }
+}
+
+hash_t
+gray_hash (const unsigned char *grays, int len)
+{
+  hash_t hash;
+
+  gray_hash_bits (grays, len, &hash);
+
+  return hash;
+}
+
+/* one bit per gray of len >= average, into (len + 63) / 64 words */
+static void
+gray_hash_bits (const unsigned char *grays, int len, hash_t *hash)
+{
+  int sum, avg, x;
+
   sum = 0;
-  for (x = 0; x < off; ++x)
+  for (x = 0; x < len; ++x)
     {
       sum += grays[x];
     }
-  avg = sum / off;
+  avg = sum / len;
 
-  hash = 0;
-  for (x = 0; x < off; ++x)
+  memset (hash, 0,
+          sizeof (hash_t) * FDUPVES_HASH_WORDS (len + FDUPVES_HASH_BITS - 1));
+  for (x = 0; x < len; ++x)
     {
       if (grays[x] >= avg)
         {
-          hash |= ((hash_t)1 << x);
+          hash[x / FDUPVES_HASH_BITS]
+              |= ((hash_t)1 << (x % FDUPVES_HASH_BITS));
         }
     }
+}
 
-  g_free (grays);
+/* difference hash of a (w + 1) x h gray grid into w * h / 64 words */
+static void
+gray_dhash_bits (const unsigned char *grays, int w, int h, hash_t *hash)
+{
+  int x, y, bit;
+  const unsigned char *row;
 
-  return hash;
+  memset (hash, 0, sizeof (hash_t) * FDUPVES_HASH_WORDS (w * h));
+  for (y = 0; y < h; ++y)
+    {
+      row = grays + y * (w + 1);
+      for (x = 0; x < w; ++x)
+        {
+          if (row[x] < row[x + 1])
+            {
+              bit = y * w + x;
+              hash[bit / FDUPVES_HASH_BITS]
+                  |= ((hash_t)1 << (bit % FDUPVES_HASH_BITS));
+            }
+        }
+    }
+}
+
+gboolean
+hash_bits_valid (int bits)
+{
+  return bits == 64 || bits == 128 || bits == 256;
+}
+
+/* the bits of a hash of bits inside area, FDUPVES_HASH_WORDS (bits) words
+ * into mask; the 64 bit hash keeps its historic masks, the wider grids
+ * keep the half of their rows or columns on that side */
+void
+hash_area_mask (int area, int bits, hash_t *mask)
+{
+  int w, h, x, y, bit;
+  gboolean in;
+
+  if (bits <= FDUPVES_HASH_BITS)
+    {
+      switch (area)
+        {
+        case FD_COMPARE_TOP:
+          *mask = 0xFFFFFF00ULL;
+          break;
+
+        case FD_COMPARE_BOTTOM:
+          *mask = 0x00FFFFFFULL;
+          break;
+
+        case FD_COMPARE_LEFT:
+          *mask = 0xFCFCFCFCULL;
+          break;
+
+        case FD_COMPARE_RIGHT:
+          *mask = 0x3F3F3F3FULL;
+          break;
+
+        default:
+          *mask = ~0ULL;
+          break;
+        }
+      return;
+    }
+
+  hash_grid (bits, &w, &h);
+  memset (mask, 0, sizeof (hash_t) * FDUPVES_HASH_WORDS (bits));
+  for (y = 0; y < h; ++y)
+    {
+      for (x = 0; x < w; ++x)
+        {
+          switch (area)
+            {
+            case FD_COMPARE_TOP:
+              in = y < h / 2;
+              break;
+
+            case FD_COMPARE_BOTTOM:
+              in = y >= h / 2;
+              break;
+
+            case FD_COMPARE_LEFT:
+              in = x < w / 2;
+              break;
+
+            case FD_COMPARE_RIGHT:
+              in = x >= w / 2;
+              break;
+
+            default:
+              in = TRUE;
+              break;
+            }
+          if (in)
+            {
+              bit = y * w + x;
+              mask[bit / FDUPVES_HASH_BITS]
+                  |= ((hash_t)1 << (bit % FDUPVES_HASH_BITS));
+            }
+        }
+    }
 }
 
 int
 hash_cmp (hash_t a, hash_t b)
 {
-  hash_t c;
-  int cmp;
+  hash_t area;
+
+  hash_area_mask (g_ini->compare_area, FDUPVES_HASH_BITS, &area);
+
+  return hash64_distance (&a, &b, &area);
+}
+
+/* a fade to black or a plain title card: the luma grid varies so little
+ * its hashes are noise, alike in every video */
+static gboolean
+luma_is_flat (const guchar *luma)
+{
+  gint64 sum, sumsq;
+  int i, n;
+
+  n = FDUPVES_LUMA_LEN * FDUPVES_LUMA_LEN;
+  for (sum = 0, sumsq = 0, i = 0; i < n; ++i)
+    {
+      sum += luma[i];
+      sumsq += luma[i] * luma[i];
+    }
+
+  /* variance below FDUPVES_LUMA_FLAT_VARIANCE, without dividing */
+  return n * sumsq - sum * sum < (gint64)FDUPVES_LUMA_FLAT_VARIANCE * n * n;
+}
+
+/* the luma grid of the frame at time, or if that one is flat of the first
+ * frame after it that is not, looking FDUPVES_VIDEO_FLAT_WINDOW seconds
+ * ahead at most; sample is set to the time of the frame returned.  Return
+ * 1 with such a frame, 0 when every frame looked at was flat, -1 when no
+ * frame could be decoded */
+static int
+video_session_informative_luma (video_session *session, float time,
+                                guchar *luma, double *sample)
+{
+  int next;
+  gboolean ok;
+
+  *sample = time;
+  if (!video_session_luma (session, time, FDUPVES_LUMA_LEN, FDUPVES_LUMA_LEN,
+                           luma, sample))
+    {
+      return -1;
+    }
+
+  for (next = (int)time; luma_is_flat (luma);)
+    {
+      /* a second on, past the keyframe just decoded in keyframe mode */
+      next = MAX (next, (int)*sample) + 1;
+      if (next > time + FDUPVES_VIDEO_FLAT_WINDOW)
+        {
+          return 0;
+        }
+
+      ok = g_ini->video_seek_keyframe
+               ? video_session_next_luma (session, next, FDUPVES_LUMA_LEN,
+                                          FDUPVES_LUMA_LEN, luma, sample)
+               : video_session_luma (session, next, FDUPVES_LUMA_LEN,
+                                     FDUPVES_LUMA_LEN, luma, sample);
+      if (!ok)
+        {
+          return 0;
+        }
+    }
+
+  return 1;
+}
+
+static int
+offset_index_cmp (const void *a, const void *b)
+{
+  float fa, fb;
+
+  fa = *((const float *const *)a)[0];
+  fb = *((const float *const *)b)[0];
+
+  return fa < fb ? -1 : fa > fb;
+}
 
-  if (!a || !b)
+/* hash the frame at each of count offsets, opening the file once and
+ * visiting the offsets in increasing order; for offset n the hashes are at
+ * hashes + n * FDUPVES_HASH_ALGS_CNT * FDUPVES_HASH_WORDS (bits), laid out
+ * as by image_file_hashes, got[n] is the mask got and sampled[n], if
+ * sampled is not NULL, the time of the frame actually hashed */
+int
+video_times_hashes (const char *file, const float *offsets, int count,
+                    int bits, int mask, hash_t *hashes, int *got,
+                    float *sampled)
+{
+  guchar luma[FDUPVES_LUMA_LEN * FDUPVES_LUMA_LEN];
+  const float **order;
+  video_session *session;
+  hash_t *h;
+  double sample;
+  float cached;
+  int n, m, i, size, done, version, ret;
+#ifdef _DEBUG
+  gchar *basename, outfile[PATH_MAX];
+#endif
+
+  g_return_val_if_fail (hash_bits_valid (bits), 0);
+
+  size = FDUPVES_HASH_ALGS_CNT * FDUPVES_HASH_WORDS (bits);
+  memset (hashes, 0, sizeof (hash_t) * size * count);
+
+  /* keyframe sampled hashes are of other frames, they are cached apart */
+  version = g_ini->video_seek_keyframe ? FDUPVES_VIDEO_KEYFRAME_HASH_VERSION
+                                       : FDUPVES_VIDEO_HASH_VERSION;
+
+  /* pointers into offsets, so the index survives the sort */
+  order = g_new (const float *, count);
+  for (n = 0, m = 0; n < count; ++n)
     {
-      return FDUPVES_HASH_LEN * FDUPVES_HASH_LEN; /* max invalid distance */
+      got[n] = 0;
+      cached = offsets[n];
+      if (g_cache)
+        {
+          got[n] = cache_get_hashes (g_cache, file, offsets[n], version, bits,
+                                     mask, hashes + n * size, &cached);
+        }
+      if (sampled)
+        {
+          sampled[n] = cached;
+        }
+      if (got[n] != mask)
+        {
+          order[m++] = offsets + n;
+        }
     }
+  qsort (order, m, sizeof (const float *), offset_index_cmp);
 
-  c = a ^ b;
-  switch (g_ini->compare_area)
+  done = count - m;
+  session
+      = m > 0 ? video_session_open (file, g_ini->video_seek_keyframe) : NULL;
+  for (i = 0; session && i < m; ++i)
     {
-    case FD_COMPARE_TOP:
-      c = c & 0xFFFFFF00ULL;
-      break;
+      n = order[i] - offsets;
+      h = hashes + n * size;
 
-    case FD_COMPARE_BOTTOM:
-      c = c & 0x00FFFFFFULL;
-      break;
+      ret = video_session_informative_luma (session, offsets[n], luma,
+                                            &sample);
+      if (ret < 0)
+        {
+          continue;
+        }
+      /* a fade or a black stretch stays so, remember it instead of
+       * looking through it again on every run */
+      if (ret == 0)
+        {
+          if (g_cache)
+            {
+              cache_set_no_hashes (g_cache, file, offsets[n], version, bits,
+                                   mask & ~got[n]);
+            }
+          got[n] = mask;
+          ++done;
+          continue;
+        }
+      if (sampled)
+        {
+          sampled[n] = sample;
+        }
+#ifdef _DEBUG
+      basename = g_path_get_basename (file);
+      g_snprintf (outfile, sizeof outfile, "%s/%s-%f.png", g_get_tmp_dir (),
+                  basename, offsets[n]);
+      g_free (basename);
+      video_time_screenshot_file (file, offsets[n], FDUPVES_LUMA_LEN * 100,
+                                  FDUPVES_LUMA_LEN * 100, outfile);
+#endif
+
+      luma_hashes (luma, bits, mask & ~got[n], h);
+
+      if (g_cache)
+        {
+          cache_set_hashes (g_cache, file, offsets[n], version, bits,
+                            mask & ~got[n], h, sample);
+        }
+      got[n] = mask;
+      ++done;
+    }
+
+  if (session)
+    {
+      video_session_close (session);
+    }
+  g_free (order);
 
-    case FD_COMPARE_LEFT:
-      c = c & 0xFCFCFCFCULL;
-      break;
+  return done;
+}
 
-    case FD_COMPARE_RIGHT:
-      c = c & 0x3F3F3F3FULL;
-      break;
+/* a signature of a length seconds video takes a frame every step seconds,
+ * step the least power of two seconds that leaves at most count frames
+ * strictly inside it; two videos then share a grid, or every other frame
+ * of the finer one is on the coarser one, whatever their lengths.  Return
+ * the frames, the step to *step */
+int
+video_signature_grid (float length, int count, float *step)
+{
+  float s;
+  int n;
 
-    default:
-      break;
+  *step = 1;
+  if (!(length > 0) || count <= 0)
+    {
+      return 0;
     }
-  for (cmp = 0; c; c = c >> 1)
+
+  for (s = 1;; s *= 2)
     {
-      if (c & 1)
+      n = (int)ceilf (length / s) - 1;
+      if (n <= count)
         {
-          ++cmp;
+          break;
         }
     }
+  *step = s;
 
-  return cmp;
+  return MAX (n, 0);
 }
 
-hash_t
-video_time_hash (const char *file, float offset)
+/* the alg hashes of the frames of video_signature_grid (length, count)
+ * over file, frame k at (k + 1) * step seconds, in count *
+ * FDUPVES_HASH_WORDS (bits) words of sig; frames that could not be decoded,
+ * and the unused ones after the grid, are left zero; return the frames
+ * got */
+int
+video_signature (const char *file, float length, int count, int bits,
+                 int alg, hash_t *sig)
 {
-  hash_t h;
-  gchar *buffer;
-  gsize len;
+  guchar luma[FDUPVES_LUMA_LEN * FDUPVES_LUMA_LEN];
+  hash_t h[FDUPVES_HASH_ALGS_CNT * FDUPVES_HASH_WORDS (FDUPVES_HASH_BITS_MAX)];
+  video_session *session;
+  double sample;
+  float step;
+  int k, n, words, got, version;
 
-  if (g_cache)
+  g_return_val_if_fail (hash_bits_valid (bits), 0);
+
+  words = FDUPVES_HASH_WORDS (bits);
+  memset (sig, 0, sizeof (hash_t) * words * count);
+
+  n = video_signature_grid (length, count, &step);
+  if (n <= 0)
     {
-      if (cache_get (g_cache, file, offset, FDUPVES_IMAGE_HASH, &h))
+      return 0;
+    }
+
+  version = FDUPVES_VIDEO_GRID_SIGNATURE_VERSION
+            | (g_ini->video_seek_keyframe ? FDUPVES_VIDEO_KEYFRAME_HASH_VERSION
+                                          : FDUPVES_VIDEO_HASH_VERSION);
+
+  got = 0;
+  if (g_cache
+      && cache_get_signature (g_cache, file, version, bits, alg, count, sig))
+    {
+      for (k = 0; k < count; ++k)
+        {
+          if (!hash_bits_is_zero (bits, sig + k * words))
+            {
+              ++got;
+            }
+        }
+      return got;
+    }
+
+  session = video_session_open (file, g_ini->video_seek_keyframe);
+  if (session == NULL)
+    {
+      return 0;
+    }
+
+  for (k = 0; k < n; ++k)
+    {
+      if (video_session_informative_luma (session, step * (k + 1), luma,
+                                          &sample)
+          <= 0)
         {
-          return h;
+          continue;
         }
+
+      luma_hashes (luma, bits, FDUPVES_HASH_MASK (alg), h);
+      memcpy (sig + k * words, h + alg * words, sizeof (hash_t) * words);
+      ++got;
     }
+  video_session_close (session);
 
-  len = FDUPVES_HASH_LEN * FDUPVES_HASH_LEN * 3;
-  buffer = g_malloc (len);
-  g_return_val_if_fail (buffer, 0);
+  if (g_cache && got > 0)
+    {
+      cache_set_signature (g_cache, file, version, bits, alg, count, sig);
+    }
 
-  video_time_screenshot (file, offset, FDUPVES_HASH_LEN, FDUPVES_HASH_LEN,
-                         buffer, len);
+  return got;
+}
 
-  h = image_buffer_hash (buffer, len);
-  g_free (buffer);
+/* about one alg hash per second over the length seconds of file, each of
+ * the first keyframe at or after a second not covered yet, so a keyframe
+ * is decoded once and hashes are at least a second apart; the times of
+ * the frames hashed go to *times and their hashes to *hashes, newly
+ * allocated; return their count */
+int
+video_timeline_hashes (const char *file, float length, int bits, int alg,
+                       float **times, hash_t **hashes)
+{
+  guchar luma[FDUPVES_LUMA_LEN * FDUPVES_LUMA_LEN];
+  hash_t h[FDUPVES_HASH_ALGS_CNT * FDUPVES_HASH_WORDS (FDUPVES_HASH_BITS_MAX)];
+  video_session *session;
+  GArray *timearray, *hasharray;
+  double sample;
+  float t;
+  int words, count, time;
+
+  g_return_val_if_fail (hash_bits_valid (bits), 0);
+
+  if (g_cache
+      && cache_get_timeline (g_cache, file,
+                             FDUPVES_VIDEO_TIMELINE_HASH_VERSION, bits, alg,
+                             times, hashes, &count))
+    {
+      return count;
+    }
 
-  if (g_cache)
+  *times = NULL;
+  *hashes = NULL;
+  session = video_session_open_sequential (file);
+  if (session == NULL)
+    {
+      return 0;
+    }
+
+  words = FDUPVES_HASH_WORDS (bits);
+  timearray = g_array_new (FALSE, FALSE, sizeof (float));
+  hasharray = g_array_new (FALSE, FALSE, sizeof (hash_t));
+  for (time = 0; time < length;)
     {
-      if (h)
+      if (!video_session_next_luma (session, time, FDUPVES_LUMA_LEN,
+                                    FDUPVES_LUMA_LEN, luma, &sample))
+        {
+          break;
+        }
+
+      /* a demuxer landing before time must not loop on one keyframe */
+      time = MAX (time, (int)sample) + 1;
+
+      if (luma_is_flat (luma))
         {
-          cache_set (g_cache, file, offset, FDUPVES_IMAGE_HASH, h);
+          continue;
         }
+
+      luma_hashes (luma, bits, FDUPVES_HASH_MASK (alg), h);
+      t = sample;
+      g_array_append_val (timearray, t);
+      g_array_append_vals (hasharray, h + alg * words, words);
     }
+  video_session_close (session);
 
-  return h;
+  count = timearray->len;
+  *times = (float *)g_array_free (timearray, FALSE);
+  *hashes = (hash_t *)g_array_free (hasharray, FALSE);
+
+  if (g_cache && count > 0)
+    {
+      cache_set_timeline (g_cache, file, FDUPVES_VIDEO_TIMELINE_HASH_VERSION,
+                          bits, alg, *times, *hashes, count);
+    }
+
+  return count;
+}
+
+/* decode the frame at offset once and compute every hash in mask from it,
+ * laid out in hashes as by image_file_hashes, return the mask got */
+int
+video_time_hashes (const char *file, float offset, int bits, int mask,
+                   hash_t *hashes)
+{
+  int got;
+
+  video_times_hashes (file, &offset, 1, bits, mask, hashes, &got, NULL);
+
+  return got;
 }
 
 hash_array_t *
 audio_hashes (const char *path)
 {
   hash_array_t *hashArray;
+  int rate, window, version;
+
+  rate = g_ini->audio_rate;
+  window = g_ini->audio_window;
+  version = FDUPVES_AUDIO_MODE_VERSION (rate, window);
 
   if (g_cache)
     {
-      if (cache_gets (g_cache, path, 0xFFFF, &hashArray))
+      if (cache_gets (g_cache, path, 0xFFFF, version, &hashArray))
         {
           g_debug ("got %s cached peak hashes: %lu", path,
                    hash_array_size (hashArray));
@@ -256,7 +751,7 @@ audio_hashes (const char *path)
     }
 
   g_debug ("get %s peak hashes ...", path);
-  hashArray = audio_fingerprint (path);
+  hashArray = audio_fingerprint (path, rate, window);
   g_debug ("get %s peak hashes: %lu", path,
            hashArray ? hash_array_size (hashArray) : 0);
 
@@ -264,7 +759,7 @@ audio_hashes (const char *path)
     {
       if (hashArray)
         {
-          cache_sets (g_cache, path, 0xFFFF, hashArray);
+          cache_sets (g_cache, path, 0xFFFF, version, hashArray);
         }
     }
 
@@ -317,3 +812,9 @@ hash_array_append (hash_array_t *hashArray, void *hash, size_t size)
   memcpy (nhash, hash, size);
   g_ptr_array_add (hashArray->array, nhash);
 }
+
+void
+hash_array_sort (hash_array_t *hashArray, GCompareFunc func)
+{
+  g_ptr_array_sort (hashArray->array, func);
+}
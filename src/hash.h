@@ -34,27 +34,196 @@ enum hash_type
   FDUPVES_IMAGE_HASH,
   FDUPVES_IMAGE_PHASH,
   FDUPVES_AUDIO_HASH,
+  FDUPVES_IMAGE_DHASH,
   FDUPVES_HASH_ALGS_CNT,
 };
 
+#define FDUPVES_HASH_MASK(alg) (1 << (alg))
+
+/* every hash computed from an image or a video frame */
+#define FDUPVES_IMAGE_HASH_MASKS                                              \
+  (FDUPVES_HASH_MASK (FDUPVES_IMAGE_HASH)                                     \
+   | FDUPVES_HASH_MASK (FDUPVES_IMAGE_PHASH)                                  \
+   | FDUPVES_HASH_MASK (FDUPVES_IMAGE_DHASH))
+
+/* side of the gray grid those hashes are computed from */
+#define FDUPVES_LUMA_LEN 32
+
 extern const char *hash_phrase[];
 
+/* Bumped whenever a path starts producing different hash values, cached
+ * hashes of another version are not used */
+#define FDUPVES_IMAGE_HASH_VERSION 3
+#define FDUPVES_VIDEO_HASH_VERSION 4
+/* audio landmarks, packed integers since 1, offsets within their window
+ * since 2, with the window in them since 3 */
+#define FDUPVES_AUDIO_HASH_VERSION 3
+
+/* and the rate and window they were taken at, so only landmarks taken
+ * the same way are matched; the rate is whole, ini.c keeps it below
+ * 0x10000 */
+#define FDUPVES_AUDIO_MODE_VERSION(rate, window)                              \
+  ((int)(FDUPVES_AUDIO_HASH_VERSION | (((guint)(window) & 0xfff) << 4)        \
+         | (((guint)(rate) & 0xffff) << 16)))
+
+/* image hashes of the embedded EXIF/JFIF thumbnail are kept apart from the
+ * ones of the full decode */
+#define FDUPVES_IMAGE_THUMB_HASH_VERSION (0x100 + FDUPVES_IMAGE_HASH_VERSION)
+
+/* video hashes sampled at the nearest keyframe are kept apart from the
+ * ones at the requested time */
+#define FDUPVES_VIDEO_KEYFRAME_HASH_VERSION (0x100 + FDUPVES_VIDEO_HASH_VERSION)
+
+/* and the per second keyframe timelines of clip search */
+#define FDUPVES_VIDEO_TIMELINE_HASH_VERSION (0x200 + FDUPVES_VIDEO_HASH_VERSION)
+
+/* whole file signatures on a fixed time grid, or-ed into the version of
+ * their frames */
+#define FDUPVES_VIDEO_GRID_SIGNATURE_VERSION 0x1000
+
 typedef unsigned long long hash_t;
 
+/* Image and video frame hashes can be wider than one hash_t, an N bit hash
+ * is stored as N / 64 consecutive words, least significant word first */
+#define FDUPVES_HASH_BITS 64
+#define FDUPVES_HASH_BITS_MAX 256
+#define FDUPVES_HASH_WORDS(bits) ((bits) / FDUPVES_HASH_BITS)
+
+static inline int
+hash_popcount (hash_t h)
+{
+#ifdef __GNUC__
+  return __builtin_popcountll (h);
+#else
+  h = h - ((h >> 1) & 0x5555555555555555ULL);
+  h = (h & 0x3333333333333333ULL) + ((h >> 2) & 0x3333333333333333ULL);
+  h = (h + (h >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+  return (int)((h * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/* Specialised per width so the word loops have a constant trip count and
+ * are unrolled (and vectorised for the wide ones).
+ * hashN_is_zero: a zero hash is an unhashed file, never near anything.
+ * hashN_cmp: hamming distance over the bits set in area, a hash_area_mask ()
+ *   of the same width.
+ * hashN_distance: hashN_cmp, or the max distance N for a zero hash.
+ * hashN_find: index of the first hash of hashes[from, n) within dist of
+ *   needle, n if none.
+ * hashN_matches: frames of the count frame signature a within dist of a
+ *   frame of signature b at most shift frames away. */
+#define FDUPVES_HASH_DEFINE(bits)                                             \
+  static inline gboolean hash##bits##_is_zero (const hash_t *h)               \
+  {                                                                           \
+    hash_t any;                                                               \
+    int i;                                                                    \
+    for (any = 0, i = 0; i < FDUPVES_HASH_WORDS (bits); ++i)                  \
+      any |= h[i];                                                            \
+    return any == 0;                                                          \
+  }                                                                           \
+                                                                              \
+  static inline int hash##bits##_cmp (const hash_t *a, const hash_t *b,      \
+                                      const hash_t *area)                     \
+  {                                                                           \
+    int i, cmp;                                                               \
+    for (cmp = 0, i = 0; i < FDUPVES_HASH_WORDS (bits); ++i)                  \
+      cmp += hash_popcount ((a[i] ^ b[i]) & area[i]);                         \
+    return cmp;                                                               \
+  }                                                                           \
+                                                                              \
+  static inline int hash##bits##_distance (const hash_t *a, const hash_t *b, \
+                                           const hash_t *area)                \
+  {                                                                           \
+    if (hash##bits##_is_zero (a) || hash##bits##_is_zero (b))                 \
+      return bits;                                                            \
+    return hash##bits##_cmp (a, b, area);                                     \
+  }                                                                           \
+                                                                              \
+  static inline gsize hash##bits##_find (const hash_t *hashes, gsize from,    \
+                                         gsize n, const hash_t *needle,       \
+                                         int dist, const hash_t *area)        \
+  {                                                                           \
+    const hash_t *h;                                                          \
+    if (hash##bits##_is_zero (needle))                                        \
+      return n;                                                               \
+    for (; from < n; ++from)                                                  \
+      {                                                                       \
+        h = hashes + from * FDUPVES_HASH_WORDS (bits);                        \
+        if (hash##bits##_cmp (h, needle, area) < dist                         \
+            && !hash##bits##_is_zero (h))                                     \
+          return from;                                                        \
+      }                                                                       \
+    return n;                                                                 \
+  }                                                                           \
+                                                                              \
+  static inline int hash##bits##_matches (const hash_t *a, const hash_t *b,   \
+                                          int count, int shift, int dist,     \
+                                          const hash_t *area)                 \
+  {                                                                           \
+    int k, to, got;                                                           \
+    for (got = 0, k = 0; k < count; ++k)                                      \
+      {                                                                       \
+        to = MIN (k + shift + 1, count);                                      \
+        if (hash##bits##_find (b, MAX (k - shift, 0), to,                     \
+                               a + k * FDUPVES_HASH_WORDS (bits), dist, area) \
+            < (gsize)to)                                                      \
+          ++got;                                                              \
+      }                                                                       \
+    return got;                                                               \
+  }
+
+FDUPVES_HASH_DEFINE (64)
+FDUPVES_HASH_DEFINE (128)
+FDUPVES_HASH_DEFINE (256)
+
+/* dispatch to the specialised functions of a run time width */
+#define FDUPVES_HASH_DISPATCH(bits, func, ...)                                \
+  ((bits) == 256   ? hash256_##func (__VA_ARGS__)                             \
+   : (bits) == 128 ? hash128_##func (__VA_ARGS__)                             \
+                   : hash64_##func (__VA_ARGS__))
+
+#define hash_bits_is_zero(bits, h) FDUPVES_HASH_DISPATCH (bits, is_zero, h)
+
+#define hash_bits_distance(bits, a, b, area)                                  \
+  FDUPVES_HASH_DISPATCH (bits, distance, a, b, area)
+
+#define hash_bits_find(bits, hashes, from, n, needle, dist, area)             \
+  FDUPVES_HASH_DISPATCH (bits, find, hashes, from, n, needle, dist, area)
+
+#define hash_bits_matches(bits, a, b, count, shift, dist, area)               \
+  FDUPVES_HASH_DISPATCH (bits, matches, a, b, count, shift, dist, area)
+
+gboolean hash_bits_valid (int bits);
+
+void hash_area_mask (int area, int bits, hash_t *mask);
+
 typedef struct
 {
   GPtrArray *array;
 } hash_array_t;
 
-hash_t image_file_hash (const char *);
+int image_file_hashes (const char *, int bits, int mask, hash_t *);
+
+int video_time_hashes (const char *, float, int bits, int mask, hash_t *);
+
+int video_times_hashes (const char *, const float *, int, int bits, int mask,
+                        hash_t *, int *, float *);
+
+int video_signature_grid (float length, int count, float *step);
+
+int video_signature (const char *, float length, int count, int bits, int alg,
+                     hash_t *);
+
+int video_timeline_hashes (const char *, float length, int bits, int alg,
+                           float **times, hash_t **);
 
 hash_t image_buffer_hash (const char *, int);
 
-hash_t video_time_hash (const char *, float);
+hash_t gray_hash (const unsigned char *, int);
 
-hash_t video_time_phash (const char *, float);
+hash_t gray_phash (const unsigned char *);
 
-hash_t image_file_phash (const char *);
+void gray_phash_bits (const unsigned char *, int, int, hash_t *);
 
 hash_array_t *audio_hashes (const char *);
 
@@ -70,4 +239,7 @@ void *hash_array_index (hash_array_t *hashArray, int index);
 
 void hash_array_append (hash_array_t *hashArray, void *hash, size_t size);
 
+/* func gets pointers to the element pointers, as g_ptr_array_sort does */
+void hash_array_sort (hash_array_t *hashArray, GCompareFunc func);
+
 #endif
@@ -25,11 +25,412 @@
  */
 
 #include "image.h"
+#include "ini.h"
+
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
 
 #ifdef WIN32
 #include "image-win.h"
 #endif
 
+#ifdef FDUPVES_HAVE_LIBJPEG
+#include <jpeglib.h>
+#include <setjmp.h>
+#endif
+
+#ifdef FDUPVES_HAVE_LIBPNG
+#include <png.h>
+#endif
+
+#ifdef FDUPVES_HAVE_LIBWEBP
+#include <webp/decode.h>
+#endif
+
+#ifdef FDUPVES_HAVE_LIBTIFF
+#include <tiffio.h>
+#endif
+
+/* embedded thumbnail aspect ratio may differ this much from the image */
+#define FDUPVES_THUMB_ASPECT_TOLERANCE 0.03
+
+/* native decoders produce at least this many times the wanted size, so the
+ * box filter has enough pixels per cell to average out aliasing */
+#define FDUPVES_LUMA_OVERSAMPLE 4
+
+/* images GdkPixbuf would have to hold whole are not hashed above this, the
+ * native decoders stream them through a luma_accum instead */
+#define FDUPVES_LUMA_PIXBUF_MAX_PIXELS (32 * 1024 * 1024)
+
+/* strips or tiles larger than this are not decoded at once */
+#define FDUPVES_LUMA_CHUNK_MAX (4 * 1024 * 1024)
+
+/* Box filter fed one source row (or row of a tile) at a time, so decoders
+ * never hold more than that of a large image.  Sources smaller than the
+ * grid are kept whole and scaled up by fdupves_luma_scale at the end. */
+typedef struct
+{
+  int sw;
+  int sh;
+  int w;
+  int h;
+
+  /* grid column of every source column */
+  int *xmap;
+  guint64 *sum;
+  guint *count;
+
+  guchar *small;
+} luma_accum;
+
+typedef struct
+{
+  guchar *data;
+  gsize size;
+} luma_buffer;
+
+static void luma_buffer_free (luma_buffer *);
+
+/* decode scratch memory, one per hashing thread */
+static GPrivate luma_private = G_PRIVATE_INIT ((GDestroyNotify)luma_buffer_free);
+
+typedef struct
+{
+  /* main image size, from the SOF marker */
+  int width;
+  int height;
+
+  /* EXIF orientation of IFD0 and IFD1, 0 if absent */
+  int orientation;
+  int thumb_orientation;
+
+  /* JPEG compressed thumbnail, EXIF IFD1 or JFXX */
+  guchar *jpeg;
+  gsize jpeg_len;
+
+  /* uncompressed RGB thumbnail, JFIF or JFXX */
+  guchar *rgb;
+  int rgb_width;
+  int rgb_height;
+} jpeg_thumb;
+
+static guint
+exif_get16 (const guchar *p, gboolean le)
+{
+  return le ? (guint)(p[0] | (p[1] << 8)) : (guint)((p[0] << 8) | p[1]);
+}
+
+static guint
+exif_get32 (const guchar *p, gboolean le)
+{
+  return le ? ((guint)p[0] | ((guint)p[1] << 8) | ((guint)p[2] << 16)
+               | ((guint)p[3] << 24))
+            : (((guint)p[0] << 24) | ((guint)p[1] << 16) | ((guint)p[2] << 8)
+               | (guint)p[3]);
+}
+
+/* walk one IFD of the TIFF structure at tiff, return the next IFD offset */
+static guint
+exif_parse_ifd (const guchar *tiff, gsize len, guint off, gboolean le,
+                gboolean ifd1, jpeg_thumb *thumb)
+{
+  guint count, i, tag, value;
+  guint thumb_off, thumb_len, compression;
+  const guchar *e;
+
+  /* off comes from the file, compared in gsize so it cannot wrap */
+  if (off == 0 || (gsize)off > len || len - off < 2)
+    {
+      return 0;
+    }
+
+  count = exif_get16 (tiff + off, le);
+  if ((len - off - 2) / 12 < (gsize)count
+      || len - off - 2 - (gsize)count * 12 < 4)
+    {
+      return 0;
+    }
+
+  thumb_off = thumb_len = 0;
+  compression = 6;
+  for (i = 0; i < count; ++i)
+    {
+      e = tiff + off + 2 + i * 12;
+      tag = exif_get16 (e, le);
+      /* SHORT values are left aligned in the 4 bytes value field */
+      if (exif_get16 (e + 2, le) == 3)
+        {
+          value = exif_get16 (e + 8, le);
+        }
+      else
+        {
+          value = exif_get32 (e + 8, le);
+        }
+
+      switch (tag)
+        {
+        case 0x0112: /* Orientation */
+          if (ifd1)
+            {
+              thumb->thumb_orientation = value;
+            }
+          else
+            {
+              thumb->orientation = value;
+            }
+          break;
+
+        case 0x0103: /* Compression */
+          compression = value;
+          break;
+
+        case 0x0201: /* JPEGInterchangeFormat */
+          thumb_off = value;
+          break;
+
+        case 0x0202: /* JPEGInterchangeFormatLength */
+          thumb_len = value;
+          break;
+
+        default:
+          break;
+        }
+    }
+
+  if (ifd1 && compression == 6 && thumb_off > 0 && thumb_len > 0
+      && thumb_off < len && thumb_len <= len - thumb_off)
+    {
+      g_free (thumb->jpeg);
+      thumb->jpeg = g_memdup2 (tiff + thumb_off, thumb_len);
+      thumb->jpeg_len = thumb_len;
+    }
+
+  return exif_get32 (tiff + off + 2 + count * 12, le);
+}
+
+static void
+exif_parse (const guchar *data, gsize len, jpeg_thumb *thumb)
+{
+  const guchar *tiff;
+  gboolean le;
+  guint ifd1;
+
+  /* "Exif\0\0" + TIFF header */
+  if (len < 6 + 8 || memcmp (data, "Exif\0\0", 6) != 0)
+    {
+      return;
+    }
+  tiff = data + 6;
+  len -= 6;
+
+  if (memcmp (tiff, "II", 2) == 0)
+    {
+      le = TRUE;
+    }
+  else if (memcmp (tiff, "MM", 2) == 0)
+    {
+      le = FALSE;
+    }
+  else
+    {
+      return;
+    }
+  if (exif_get16 (tiff + 2, le) != 42)
+    {
+      return;
+    }
+
+  ifd1 = exif_parse_ifd (tiff, len, exif_get32 (tiff + 4, le), le, FALSE,
+                         thumb);
+  exif_parse_ifd (tiff, len, ifd1, le, TRUE, thumb);
+}
+
+static void
+jfif_parse (const guchar *data, gsize len, jpeg_thumb *thumb)
+{
+  int w, h;
+
+  if (len >= 14 && memcmp (data, "JFIF\0", 5) == 0)
+    {
+      w = data[12];
+      h = data[13];
+      if (w > 0 && h > 0 && len >= 14 + (gsize)w * h * 3 && thumb->rgb == NULL)
+        {
+          thumb->rgb = g_memdup2 (data + 14, w * h * 3);
+          thumb->rgb_width = w;
+          thumb->rgb_height = h;
+        }
+    }
+  else if (len >= 6 && memcmp (data, "JFXX\0", 5) == 0)
+    {
+      if (data[5] == 0x10 && thumb->jpeg == NULL)
+        {
+          thumb->jpeg = g_memdup2 (data + 6, len - 6);
+          thumb->jpeg_len = len - 6;
+        }
+      else if (data[5] == 0x13 && len >= 8 && thumb->rgb == NULL)
+        {
+          w = data[6];
+          h = data[7];
+          if (w > 0 && h > 0 && len >= 8 + (gsize)w * h * 3)
+            {
+              thumb->rgb = g_memdup2 (data + 8, w * h * 3);
+              thumb->rgb_width = w;
+              thumb->rgb_height = h;
+            }
+        }
+    }
+}
+
+/* read the APPn segments and the frame header of a JPEG file, stop before
+ * the entropy coded data so only a few kilobytes are read */
+static gboolean
+jpeg_thumb_read (const gchar *file, jpeg_thumb *thumb)
+{
+  FILE *fp;
+  guchar head[4], *seg;
+  int marker, len;
+
+  fp = g_fopen (file, "rb");
+  if (fp == NULL)
+    {
+      return FALSE;
+    }
+
+  if (fread (head, 1, 2, fp) != 2 || head[0] != 0xFF || head[1] != 0xD8)
+    {
+      fclose (fp);
+      return FALSE;
+    }
+
+  while (thumb->width == 0)
+    {
+      if (fread (head, 1, 2, fp) != 2 || head[0] != 0xFF)
+        {
+          break;
+        }
+      marker = head[1];
+      while (marker == 0xFF)
+        {
+          marker = fgetc (fp);
+        }
+      if (marker == EOF || marker == 0xD9 || marker == 0xDA)
+        {
+          break;
+        }
+      if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+        {
+          continue;
+        }
+
+      if (fread (head, 1, 2, fp) != 2)
+        {
+          break;
+        }
+      len = ((head[0] << 8) | head[1]) - 2;
+      if (len < 0)
+        {
+          break;
+        }
+
+      if (marker == 0xE0 || marker == 0xE1)
+        {
+          seg = g_malloc (len);
+          if (fread (seg, 1, len, fp) != (size_t)len)
+            {
+              g_free (seg);
+              break;
+            }
+          if (marker == 0xE1)
+            {
+              exif_parse (seg, len, thumb);
+            }
+          else
+            {
+              jfif_parse (seg, len, thumb);
+            }
+          g_free (seg);
+        }
+      else if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4
+               && marker != 0xC8 && marker != 0xCC)
+        {
+          guchar sof[5];
+          if (len < 5 || fread (sof, 1, 5, fp) != 5)
+            {
+              break;
+            }
+          thumb->height = (sof[1] << 8) | sof[2];
+          thumb->width = (sof[3] << 8) | sof[4];
+        }
+      else if (fseek (fp, len, SEEK_CUR) != 0)
+        {
+          break;
+        }
+    }
+
+  fclose (fp);
+
+  return thumb->width > 0 && thumb->height > 0;
+}
+
+static void
+jpeg_thumb_clear (jpeg_thumb *thumb)
+{
+  g_free (thumb->jpeg);
+  g_free (thumb->rgb);
+}
+
+static GdkPixbuf *
+jpeg_thumb_decode (jpeg_thumb *thumb)
+{
+  GdkPixbufLoader *loader;
+  GdkPixbuf *buf;
+  GError *err;
+
+  buf = NULL;
+  if (thumb->jpeg)
+    {
+      err = NULL;
+      loader = gdk_pixbuf_loader_new_with_type ("jpeg", &err);
+      if (loader == NULL)
+        {
+          g_error_free (err);
+          return NULL;
+        }
+      if (gdk_pixbuf_loader_write (loader, thumb->jpeg, thumb->jpeg_len,
+                                   NULL)
+          && gdk_pixbuf_loader_close (loader, NULL))
+        {
+          buf = gdk_pixbuf_loader_get_pixbuf (loader);
+          if (buf)
+            {
+              g_object_ref (buf);
+            }
+        }
+      else
+        {
+          gdk_pixbuf_loader_close (loader, NULL);
+        }
+      g_object_unref (loader);
+    }
+
+  if (buf == NULL && thumb->rgb)
+    {
+      buf = gdk_pixbuf_new_from_data (
+          thumb->rgb, GDK_COLORSPACE_RGB, FALSE, 8, thumb->rgb_width,
+          thumb->rgb_height, thumb->rgb_width * 3,
+          (GdkPixbufDestroyNotify)g_free, NULL);
+      if (buf)
+        {
+          /* the pixbuf owns the pixels now */
+          thumb->rgb = NULL;
+        }
+    }
+
+  return buf;
+}
+
 GdkPixbuf *
 fdupves_gdkpixbuf_load_file_at_size (const gchar *file, int w, int h,
                                      GError **error)
@@ -66,3 +467,754 @@ fdupves_gdkpixbuf_load_file_at_size (const gchar *file, int w, int h,
 
   return buf;
 }
+
+GdkPixbuf *
+fdupves_gdkpixbuf_load_thumbnail_at_size (const gchar *file, int w, int h)
+{
+  jpeg_thumb thumb[1];
+  GdkPixbuf *buf, *scaled;
+  double main_ratio, thumb_ratio;
+
+  memset (thumb, 0, sizeof thumb);
+  if (!jpeg_thumb_read (file, thumb)
+      || (thumb->jpeg == NULL && thumb->rgb == NULL))
+    {
+      jpeg_thumb_clear (thumb);
+      return NULL;
+    }
+
+  /* a thumbnail stored for another orientation is not the same picture */
+  if (thumb->thumb_orientation != 0
+      && thumb->thumb_orientation != thumb->orientation)
+    {
+      jpeg_thumb_clear (thumb);
+      return NULL;
+    }
+
+  buf = jpeg_thumb_decode (thumb);
+  jpeg_thumb_clear (thumb);
+  if (buf == NULL)
+    {
+      return NULL;
+    }
+
+  /* letter-boxed or rotated thumbnails would hash a different picture */
+  main_ratio = (double)thumb->width / thumb->height;
+  thumb_ratio = (double)gdk_pixbuf_get_width (buf) / gdk_pixbuf_get_height (buf);
+  if (thumb_ratio < main_ratio * (1.0 - FDUPVES_THUMB_ASPECT_TOLERANCE)
+      || thumb_ratio > main_ratio * (1.0 + FDUPVES_THUMB_ASPECT_TOLERANCE))
+    {
+      g_debug ("%s: thumbnail %dx%d does not match image %dx%d", file,
+               gdk_pixbuf_get_width (buf), gdk_pixbuf_get_height (buf),
+               thumb->width, thumb->height);
+      g_object_unref (buf);
+      return NULL;
+    }
+
+  scaled = gdk_pixbuf_scale_simple (buf, w, h, GDK_INTERP_BILINEAR);
+  g_object_unref (buf);
+
+  return scaled;
+}
+
+static void
+luma_buffer_free (luma_buffer *buf)
+{
+  g_free (buf->data);
+  g_free (buf);
+}
+
+static guchar *
+luma_buffer_get (gsize size)
+{
+  luma_buffer *buf;
+
+  buf = g_private_get (&luma_private);
+  if (buf == NULL)
+    {
+      buf = g_new0 (luma_buffer, 1);
+      g_private_set (&luma_private, buf);
+    }
+
+  if (buf->size < size)
+    {
+      g_free (buf->data);
+      buf->data = g_malloc (size);
+      buf->size = size;
+    }
+
+  return buf->data;
+}
+
+/* area average the sw x sh src into the w x h out grid */
+void
+fdupves_luma_scale (const guchar *src, int sw, int sh, int stride, guchar *out,
+                    int w, int h)
+{
+  int x, y, sx, sy, x0, x1, y0, y1;
+  guint sum;
+  const guchar *row;
+
+  for (y = 0; y < h; ++y)
+    {
+      y0 = (int)((gint64)y * sh / h);
+      y1 = (int)((gint64)(y + 1) * sh / h);
+      if (y1 <= y0)
+        {
+          y1 = y0 + 1;
+        }
+
+      for (x = 0; x < w; ++x)
+        {
+          x0 = (int)((gint64)x * sw / w);
+          x1 = (int)((gint64)(x + 1) * sw / w);
+          if (x1 <= x0)
+            {
+              x1 = x0 + 1;
+            }
+
+          sum = 0;
+          for (sy = y0; sy < y1; ++sy)
+            {
+              row = src + (gsize)sy * stride;
+              for (sx = x0; sx < x1; ++sx)
+                {
+                  sum += row[sx];
+                }
+            }
+          out[y * w + x] = sum / ((y1 - y0) * (x1 - x0));
+        }
+    }
+}
+
+static void
+pixbuf_to_luma (GdkPixbuf *pixbuf, guchar *out, int w, int h)
+{
+  int x, y, rowstride, n_channels;
+  guchar *pixels, *p;
+
+  g_assert (gdk_pixbuf_get_width (pixbuf) == w);
+  g_assert (gdk_pixbuf_get_height (pixbuf) == h);
+
+  n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+
+  for (y = 0; y < h; ++y)
+    {
+      for (x = 0; x < w; ++x)
+        {
+          p = pixels + y * rowstride + x * n_channels;
+          out[y * w + x] = (p[0] * 30 + p[1] * 59 + p[2] * 11) / 100;
+        }
+    }
+}
+
+/* the grid cell of source index i, the inverse of the ranges of
+ * fdupves_luma_scale when the source is at least as large as the grid */
+static inline int
+luma_accum_cell (int i, int src, int dst)
+{
+  return (int)(((gint64)(i + 1) * dst - 1) / src);
+}
+
+static void
+luma_accum_init (luma_accum *acc, int sw, int sh, int w, int h)
+{
+  int x;
+
+  acc->sw = sw;
+  acc->sh = sh;
+  acc->w = w;
+  acc->h = h;
+
+  if (sw < w || sh < h)
+    {
+      acc->small = g_new0 (guchar, (gsize)sw * sh);
+      return;
+    }
+
+  acc->xmap = g_new (int, sw);
+  for (x = 0; x < sw; ++x)
+    {
+      acc->xmap[x] = luma_accum_cell (x, sw, w);
+    }
+  acc->sum = g_new0 (guint64, w * h);
+  acc->count = g_new0 (guint, w * h);
+}
+
+/* add n grays of source row y, at columns x, x + step, ... */
+static void
+luma_accum_row (luma_accum *acc, int y, const guchar *gray, int x, int step,
+                int n)
+{
+  guint64 *sum;
+  guint *count;
+  int i, cell;
+
+  if (acc->small)
+    {
+      for (i = 0; i < n; ++i, x += step)
+        {
+          acc->small[(gsize)y * acc->sw + x] = gray[i];
+        }
+      return;
+    }
+
+  sum = acc->sum + luma_accum_cell (y, acc->sh, acc->h) * acc->w;
+  count = acc->count + luma_accum_cell (y, acc->sh, acc->h) * acc->w;
+  for (i = 0; i < n; ++i, x += step)
+    {
+      cell = acc->xmap[x];
+      sum[cell] += gray[i];
+      ++count[cell];
+    }
+}
+
+static gboolean
+luma_accum_finish (luma_accum *acc, guchar *out)
+{
+  int i;
+
+  if (acc->small)
+    {
+      fdupves_luma_scale (acc->small, acc->sw, acc->sh, acc->sw, out, acc->w,
+                          acc->h);
+      return TRUE;
+    }
+
+  if (acc->sum == NULL)
+    {
+      return FALSE;
+    }
+
+  for (i = 0; i < acc->w * acc->h; ++i)
+    {
+      if (acc->count[i] == 0)
+        {
+          return FALSE;
+        }
+      out[i] = acc->sum[i] / acc->count[i];
+    }
+
+  return TRUE;
+}
+
+static void
+luma_accum_clear (luma_accum *acc)
+{
+  g_free (acc->xmap);
+  g_free (acc->sum);
+  g_free (acc->count);
+  g_free (acc->small);
+  memset (acc, 0, sizeof (luma_accum));
+}
+
+static inline guchar
+rgb_to_luma (guint r, guint g, guint b)
+{
+  return (r * 30 + g * 59 + b * 11) / 100;
+}
+
+#ifdef FDUPVES_HAVE_LIBJPEG
+struct luma_jpeg_error
+{
+  struct jpeg_error_mgr mgr;
+  jmp_buf jmp;
+};
+
+static void
+luma_jpeg_error_exit (j_common_ptr cinfo)
+{
+  struct luma_jpeg_error *err = (struct luma_jpeg_error *)cinfo->err;
+  longjmp (err->jmp, 1);
+}
+
+static void
+luma_jpeg_output_message (j_common_ptr cinfo)
+{
+}
+
+/* decode the Y channel only, with the IDCT scaled down by up to 8, one
+ * scanline at a time */
+static gboolean
+luma_decode_jpeg (FILE *fp, int w, int h, luma_accum *acc)
+{
+  struct jpeg_decompress_struct cinfo;
+  struct luma_jpeg_error jerr;
+  JSAMPROW row;
+  int denom, y;
+
+  cinfo.err = jpeg_std_error (&jerr.mgr);
+  jerr.mgr.error_exit = luma_jpeg_error_exit;
+  jerr.mgr.output_message = luma_jpeg_output_message;
+  if (setjmp (jerr.jmp))
+    {
+      jpeg_destroy_decompress (&cinfo);
+      return FALSE;
+    }
+
+  jpeg_create_decompress (&cinfo);
+  jpeg_stdio_src (&cinfo, fp);
+  jpeg_read_header (&cinfo, TRUE);
+
+  /* libjpeg can not turn these into gray, leave them to GdkPixbuf */
+  if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK)
+    {
+      jpeg_destroy_decompress (&cinfo);
+      return FALSE;
+    }
+
+  for (denom = 8; denom > 1; denom >>= 1)
+    {
+      if ((int)cinfo.image_width / denom >= w * FDUPVES_LUMA_OVERSAMPLE
+          && (int)cinfo.image_height / denom >= h * FDUPVES_LUMA_OVERSAMPLE)
+        {
+          break;
+        }
+    }
+
+  cinfo.out_color_space = JCS_GRAYSCALE;
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = denom;
+  cinfo.dct_method = JDCT_IFAST;
+  cinfo.do_fancy_upsampling = FALSE;
+  cinfo.do_block_smoothing = FALSE;
+
+  jpeg_start_decompress (&cinfo);
+
+  luma_accum_init (acc, cinfo.output_width, cinfo.output_height, w, h);
+  row = luma_buffer_get (cinfo.output_width);
+  while (cinfo.output_scanline < cinfo.output_height)
+    {
+      y = cinfo.output_scanline;
+      jpeg_read_scanlines (&cinfo, &row, 1);
+      luma_accum_row (acc, y, row, 0, 1, cinfo.output_width);
+    }
+
+  jpeg_finish_decompress (&cinfo);
+  jpeg_destroy_decompress (&cinfo);
+
+  return TRUE;
+}
+#endif
+
+#ifdef FDUPVES_HAVE_LIBPNG
+static void
+luma_png_warning (png_structp png, png_const_charp msg)
+{
+}
+
+/* read row by row, with libpng turning every format into 8 bit gray on
+ * black; Adam7 passes are fed as they come, each pixel lands in its cell
+ * whatever pass it is in */
+static gboolean
+luma_decode_png (FILE *fp, int w, int h, luma_accum *acc)
+{
+  png_structp png;
+  png_infop info;
+  png_color_16 background;
+  png_uint_32 width, height, rows, cols, y;
+  int bit_depth, color_type, interlace, pass, passes;
+  int x0, y0, xstep, ystep;
+  guchar *row;
+
+  png = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL,
+                                luma_png_warning);
+  if (png == NULL)
+    {
+      return FALSE;
+    }
+  info = png_create_info_struct (png);
+  if (info == NULL)
+    {
+      png_destroy_read_struct (&png, NULL, NULL);
+      return FALSE;
+    }
+  if (setjmp (png_jmpbuf (png)))
+    {
+      png_destroy_read_struct (&png, &info, NULL);
+      return FALSE;
+    }
+
+  png_init_io (png, fp);
+  png_read_info (png, info);
+  png_get_IHDR (png, info, &width, &height, &bit_depth, &color_type,
+                &interlace, NULL, NULL);
+
+  png_set_expand (png);
+  png_set_scale_16 (png);
+  if (color_type & PNG_COLOR_MASK_COLOR)
+    {
+      png_set_rgb_to_gray_fixed (png, 1, -1, -1);
+    }
+  if ((color_type & PNG_COLOR_MASK_ALPHA)
+      || png_get_valid (png, info, PNG_INFO_tRNS))
+    {
+      memset (&background, 0, sizeof background);
+      png_set_background_fixed (png, &background,
+                                PNG_BACKGROUND_GAMMA_SCREEN, 0, PNG_FP_1);
+    }
+  png_read_update_info (png, info);
+
+  luma_accum_init (acc, width, height, w, h);
+  row = luma_buffer_get (png_get_rowbytes (png, info));
+
+  passes = interlace == PNG_INTERLACE_ADAM7 ? PNG_INTERLACE_ADAM7_PASSES : 1;
+  for (pass = 0; pass < passes; ++pass)
+    {
+      if (passes == 1)
+        {
+          rows = height;
+          cols = width;
+          x0 = y0 = 0;
+          xstep = ystep = 1;
+        }
+      else
+        {
+          rows = PNG_PASS_ROWS (height, pass);
+          cols = PNG_PASS_COLS (width, pass);
+          x0 = PNG_PASS_START_COL (pass);
+          y0 = PNG_PASS_START_ROW (pass);
+          xstep = 1 << PNG_PASS_COL_SHIFT (pass);
+          ystep = 1 << PNG_PASS_ROW_SHIFT (pass);
+        }
+
+      /* libpng skips empty passes */
+      if (rows == 0 || cols == 0)
+        {
+          continue;
+        }
+
+      for (y = 0; y < rows; ++y)
+        {
+          png_read_row (png, row, NULL);
+          luma_accum_row (acc, y0 + y * ystep, row, x0, xstep, cols);
+        }
+    }
+
+  png_read_end (png, NULL);
+  png_destroy_read_struct (&png, &info, NULL);
+
+  return TRUE;
+}
+#endif
+
+#ifdef FDUPVES_HAVE_LIBWEBP
+/* decode to YUV with the scaler of libwebp and keep the Y plane */
+static gboolean
+luma_decode_webp (const gchar *file, int w, int h, luma_accum *acc)
+{
+  WebPDecoderConfig config;
+  gchar *contents;
+  gsize len, ysize, uvsize;
+  int sw, sh, y;
+  guchar *data;
+  gboolean ret;
+
+  if (!g_file_get_contents (file, &contents, &len, NULL))
+    {
+      return FALSE;
+    }
+
+  ret = FALSE;
+  if (!WebPInitDecoderConfig (&config)
+      || WebPGetFeatures ((const uint8_t *)contents, len, &config.input)
+             != VP8_STATUS_OK)
+    {
+      g_free (contents);
+      return FALSE;
+    }
+
+  sw = MIN (config.input.width, w * FDUPVES_LUMA_OVERSAMPLE);
+  sh = MIN (config.input.height, h * FDUPVES_LUMA_OVERSAMPLE);
+  ysize = (gsize)sw * sh;
+  uvsize = (gsize)((sw + 1) / 2) * ((sh + 1) / 2);
+  data = luma_buffer_get (ysize + uvsize * 2);
+
+  config.options.use_scaling = 1;
+  config.options.scaled_width = sw;
+  config.options.scaled_height = sh;
+  config.options.no_fancy_upsampling = 1;
+  config.output.colorspace = MODE_YUV;
+  config.output.is_external_memory = 1;
+  config.output.u.YUVA.y = data;
+  config.output.u.YUVA.y_stride = sw;
+  config.output.u.YUVA.y_size = ysize;
+  config.output.u.YUVA.u = data + ysize;
+  config.output.u.YUVA.u_stride = (sw + 1) / 2;
+  config.output.u.YUVA.u_size = uvsize;
+  config.output.u.YUVA.v = data + ysize + uvsize;
+  config.output.u.YUVA.v_stride = (sw + 1) / 2;
+  config.output.u.YUVA.v_size = uvsize;
+
+  if (WebPDecode ((const uint8_t *)contents, len, &config) == VP8_STATUS_OK)
+    {
+      luma_accum_init (acc, sw, sh, w, h);
+      for (y = 0; y < sh; ++y)
+        {
+          luma_accum_row (acc, y, data + (gsize)y * sw, 0, 1, sw);
+        }
+      ret = TRUE;
+    }
+
+  WebPFreeDecBuffer (&config.output);
+  g_free (contents);
+
+  return ret;
+}
+#endif
+
+#ifdef FDUPVES_HAVE_LIBTIFF
+/* feed rows of a bottom-up TIFFRGBA raster, image row y at raster row
+ * rows - 1, as TIFFReadRGBATile and TIFFReadRGBAStrip lay them out */
+static void
+luma_accum_rgba (luma_accum *acc, const uint32_t *raster, int stride, int x,
+                 int y, int cols, int rows, guchar *gray)
+{
+  const uint32_t *src;
+  int i, j;
+
+  for (j = 0; j < rows; ++j)
+    {
+      src = raster + (gsize)(rows - 1 - j) * stride;
+      for (i = 0; i < cols; ++i)
+        {
+          gray[i] = rgb_to_luma (TIFFGetR (src[i]), TIFFGetG (src[i]),
+                                 TIFFGetB (src[i]));
+        }
+      luma_accum_row (acc, y + j, gray, x, 1, cols);
+    }
+}
+
+/* scanlines of plain 8 bit gray or RGB strips are read one at a time,
+ * anything else goes through the RGBA reader tile by tile or strip by
+ * strip */
+static gboolean
+luma_decode_tiff (const gchar *file, int w, int h, luma_accum *acc)
+{
+  TIFF *tif;
+  uint32_t width, height, tw, th, rps, x, y, rows;
+  uint16_t spp, bps, photometric, planar;
+  uint32_t *raster;
+  guchar *line, *gray, *p;
+  gboolean plain, ret;
+
+  tif = TIFFOpen (file, "r");
+  if (tif == NULL)
+    {
+      return FALSE;
+    }
+
+  ret = FALSE;
+  if (!TIFFGetField (tif, TIFFTAG_IMAGEWIDTH, &width)
+      || !TIFFGetField (tif, TIFFTAG_IMAGELENGTH, &height) || width == 0
+      || height == 0)
+    {
+      TIFFClose (tif);
+      return FALSE;
+    }
+  TIFFGetFieldDefaulted (tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
+  TIFFGetFieldDefaulted (tif, TIFFTAG_BITSPERSAMPLE, &bps);
+  TIFFGetFieldDefaulted (tif, TIFFTAG_PLANARCONFIG, &planar);
+  if (!TIFFGetField (tif, TIFFTAG_PHOTOMETRIC, &photometric))
+    {
+      photometric = PHOTOMETRIC_MINISBLACK;
+    }
+
+  plain = !TIFFIsTiled (tif) && bps == 8 && planar == PLANARCONFIG_CONTIG
+          && ((photometric == PHOTOMETRIC_MINISBLACK && spp >= 1)
+              || (photometric == PHOTOMETRIC_MINISWHITE && spp >= 1)
+              || (photometric == PHOTOMETRIC_RGB && spp >= 3));
+
+  if (plain)
+    {
+      line = luma_buffer_get (TIFFScanlineSize (tif) + (gsize)width);
+      gray = line + TIFFScanlineSize (tif);
+      luma_accum_init (acc, width, height, w, h);
+      for (y = 0; y < height; ++y)
+        {
+          if (TIFFReadScanline (tif, line, y, 0) < 0)
+            {
+              break;
+            }
+          for (x = 0, p = line; x < width; ++x, p += spp)
+            {
+              if (photometric == PHOTOMETRIC_RGB)
+                {
+                  gray[x] = rgb_to_luma (p[0], p[1], p[2]);
+                }
+              else if (photometric == PHOTOMETRIC_MINISWHITE)
+                {
+                  gray[x] = 255 - p[0];
+                }
+              else
+                {
+                  gray[x] = p[0];
+                }
+            }
+          luma_accum_row (acc, y, gray, 0, 1, width);
+        }
+      ret = y == height;
+    }
+  else if (TIFFIsTiled (tif))
+    {
+      TIFFGetField (tif, TIFFTAG_TILEWIDTH, &tw);
+      TIFFGetField (tif, TIFFTAG_TILELENGTH, &th);
+      if (tw > 0 && th > 0 && (gsize)tw * th * 4 <= FDUPVES_LUMA_CHUNK_MAX)
+        {
+          raster = (uint32_t *)luma_buffer_get ((gsize)tw * th * 4 + tw);
+          gray = (guchar *)(raster + (gsize)tw * th);
+          luma_accum_init (acc, width, height, w, h);
+          ret = TRUE;
+          for (y = 0; ret && y < height; y += th)
+            {
+              for (x = 0; ret && x < width; x += tw)
+                {
+                  ret = TIFFReadRGBATile (tif, x, y, raster);
+                  if (ret)
+                    {
+                      /* edge tiles are moved to the bottom of the raster */
+                      rows = MIN (th, height - y);
+                      luma_accum_rgba (acc, raster + (gsize)(th - rows) * tw,
+                                       tw, x, y, MIN (tw, width - x), rows,
+                                       gray);
+                    }
+                }
+            }
+        }
+    }
+  else
+    {
+      TIFFGetFieldDefaulted (tif, TIFFTAG_ROWSPERSTRIP, &rps);
+      rps = MIN (rps, height);
+      if ((gsize)rps * width * 4 <= FDUPVES_LUMA_CHUNK_MAX)
+        {
+          raster
+              = (uint32_t *)luma_buffer_get ((gsize)rps * width * 4 + width);
+          gray = (guchar *)(raster + (gsize)rps * width);
+          luma_accum_init (acc, width, height, w, h);
+          ret = TRUE;
+          for (y = 0; ret && y < height; y += rps)
+            {
+              rows = MIN (rps, height - y);
+              ret = TIFFReadRGBAStrip (tif, y, raster);
+              if (ret)
+                {
+                  luma_accum_rgba (acc, raster, width, 0, y, width, rows,
+                                   gray);
+                }
+            }
+        }
+    }
+
+  TIFFClose (tif);
+
+  return ret;
+}
+#endif
+
+/* decode file with a streaming native decoder into the w x h out grid */
+static gboolean
+luma_decode (const gchar *file, int w, int h, guchar *out)
+{
+  FILE *fp;
+  guchar magic[12];
+  luma_accum acc[1];
+  gboolean ret;
+
+  fp = g_fopen (file, "rb");
+  if (fp == NULL)
+    {
+      return FALSE;
+    }
+
+  memset (acc, 0, sizeof acc);
+  ret = FALSE;
+  if (fread (magic, 1, sizeof magic, fp) == sizeof magic)
+    {
+      rewind (fp);
+#ifdef FDUPVES_HAVE_LIBJPEG
+      if (magic[0] == 0xFF && magic[1] == 0xD8 && magic[2] == 0xFF)
+        {
+          ret = luma_decode_jpeg (fp, w, h, acc);
+        }
+#endif
+#ifdef FDUPVES_HAVE_LIBPNG
+      if (memcmp (magic, "\x89PNG\r\n\x1a\n", 8) == 0)
+        {
+          ret = luma_decode_png (fp, w, h, acc);
+        }
+#endif
+#ifdef FDUPVES_HAVE_LIBWEBP
+      if (memcmp (magic, "RIFF", 4) == 0 && memcmp (magic + 8, "WEBP", 4) == 0)
+        {
+          ret = luma_decode_webp (file, w, h, acc);
+        }
+#endif
+#ifdef FDUPVES_HAVE_LIBTIFF
+      if (memcmp (magic, "II*\0", 4) == 0 || memcmp (magic, "MM\0*", 4) == 0)
+        {
+          ret = luma_decode_tiff (file, w, h, acc);
+        }
+#endif
+    }
+
+  fclose (fp);
+
+  if (ret)
+    {
+      ret = luma_accum_finish (acc, out);
+    }
+  luma_accum_clear (acc);
+
+  return ret;
+}
+
+gboolean
+fdupves_image_load_luma (const gchar *file, int w, int h, guchar *out)
+{
+  GdkPixbuf *buf;
+  GError *err;
+  int width, height;
+
+  if (g_ini->image_thumbnail)
+    {
+      buf = fdupves_gdkpixbuf_load_thumbnail_at_size (file, w, h);
+      if (buf)
+        {
+          pixbuf_to_luma (buf, out, w, h);
+          g_object_unref (buf);
+          return TRUE;
+        }
+    }
+
+  if (luma_decode (file, w, h, out))
+    {
+      return TRUE;
+    }
+
+  /* GdkPixbuf decodes the whole image before scaling it down */
+  if (gdk_pixbuf_get_file_info (file, &width, &height)
+      && (gint64)width * height > FDUPVES_LUMA_PIXBUF_MAX_PIXELS)
+    {
+      g_warning ("Image file: %s is %dx%d, too large to hash without a "
+                 "streaming decoder.",
+                 file, width, height);
+      return FALSE;
+    }
+
+  err = NULL;
+  buf = fdupves_gdkpixbuf_load_file_at_size (file, w, h, &err);
+  if (err)
+    {
+      g_warning ("Load file: %s to pixbuf failed: %s", file, err->message);
+      g_error_free (err);
+      return FALSE;
+    }
+
+  pixbuf_to_luma (buf, out, w, h);
+  g_object_unref (buf);
+
+  return TRUE;
+}
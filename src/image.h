@@ -31,4 +31,10 @@
 GdkPixbuf *fdupves_gdkpixbuf_load_file_at_size (const gchar *, int, int,
                                                 GError **);
 
+GdkPixbuf *fdupves_gdkpixbuf_load_thumbnail_at_size (const gchar *, int, int);
+
+gboolean fdupves_image_load_luma (const gchar *, int, int, guchar *);
+
+void fdupves_luma_scale (const guchar *, int, int, int, guchar *, int, int);
+
 #endif
@@ -26,6 +26,8 @@
 /* @date Created: 2013/01/16 12:03:42 Alf*/
 
 #include "ini.h"
+#include "audio.h"
+#include "hash.h"
 #include "util.h"
 
 #include <glib.h>
@@ -60,9 +62,11 @@ ini_new ()
 
   ini->proc_image = FALSE;
   ini->image_suffix = g_strsplit (isuffix, ",", -1);
+  ini->image_thumbnail = FALSE;
 
   ini->proc_video = TRUE;
   ini->video_suffix = g_strsplit (vsuffix, ",", -1);
+  ini->video_seek_keyframe = FALSE;
 
   ini->proc_audio = TRUE;
   ini->audio_suffix = g_strsplit (asuffix, ",", -1);
@@ -74,15 +78,21 @@ ini_new ()
 
   ini->compare_area = 0;
 
+  ini->hash_alg = FDUPVES_IMAGE_HASH;
+  ini->hash_bits = FDUPVES_HASH_BITS;
+
   ini->filter_time_rate = 0;
 
   ini->compare_count = 4;
 
+  ini->audio_rate = FDUPVES_AUDIO_RATE;
+  ini->audio_window = 0;
+
   ini->same_image_distance = 6;
   ini->same_video_distance = 8;
   ini->same_audio_distance = 2;
 
-  ini->threads_count = 1;
+  ini->threads_count = g_get_num_processors ();
   ini->ebook_viewer = g_strdup ("apvlv");
 
   ini->thumb_size[0] = 512;
@@ -149,7 +159,7 @@ gboolean
 ini_load (ini_t *ini, const gchar *file)
 {
   gchar *path, *tmpstr;
-  gint level, count;
+  gint level, count, alg;
   GError *err;
 
   path = fd_realpath (file);
@@ -230,12 +240,60 @@ ini_load (ini_t *ini, const gchar *file)
       ini->ebook_viewer = g_strdup (tmpstr);
     }
 
+  if (g_key_file_has_key (ini->keyfile, "_", "image_thumbnail", NULL))
+    {
+      ini->image_thumbnail = g_key_file_get_boolean (
+          ini->keyfile, "_", "image_thumbnail", NULL);
+    }
+
+  if (g_key_file_has_key (ini->keyfile, "_", "video_seek_keyframe", NULL))
+    {
+      ini->video_seek_keyframe = g_key_file_get_boolean (
+          ini->keyfile, "_", "video_seek_keyframe", NULL);
+    }
+
   if (g_key_file_has_key (ini->keyfile, "_", "compare_area", NULL))
     {
       ini->compare_area
           = g_key_file_get_integer (ini->keyfile, "_", "compare_area", NULL);
     }
 
+  tmpstr = g_key_file_get_string (ini->keyfile, "_", "hash_alg", NULL);
+  if (tmpstr != NULL)
+    {
+      for (alg = 0; alg < FDUPVES_HASH_ALGS_CNT; ++alg)
+        {
+          if (alg != FDUPVES_AUDIO_HASH
+              && g_ascii_strcasecmp (tmpstr, hash_phrase[alg]) == 0)
+            {
+              ini->hash_alg = alg;
+              break;
+            }
+        }
+      if (alg == FDUPVES_HASH_ALGS_CNT)
+        {
+          g_warning ("configuration file: %s hash_alg %s unknown, set as "
+                     "default.",
+                     file, tmpstr);
+        }
+      g_free (tmpstr);
+    }
+
+  if (g_key_file_has_key (ini->keyfile, "_", "hash_bits", NULL))
+    {
+      count = g_key_file_get_integer (ini->keyfile, "_", "hash_bits", NULL);
+      if (hash_bits_valid (count))
+        {
+          ini->hash_bits = count;
+        }
+      else
+        {
+          g_warning ("configuration file: %s hash_bits %d unsupported, set "
+                     "as default.",
+                     file, count);
+        }
+    }
+
   if (g_key_file_has_key (ini->keyfile, "_", "filter_time_rate", NULL))
     {
       ini->filter_time_rate = g_key_file_get_integer (
@@ -248,6 +306,25 @@ ini_load (ini_t *ini, const gchar *file)
           = g_key_file_get_integer (ini->keyfile, "_", "compare_count", NULL);
     }
 
+  if (g_key_file_has_key (ini->keyfile, "_", "audio_rate", NULL))
+    {
+      ini->audio_rate
+          = g_key_file_get_integer (ini->keyfile, "_", "audio_rate", NULL);
+      if (ini->audio_rate < 4000 || ini->audio_rate > 48000)
+        {
+          g_warning ("configuration file: %s audio_rate %d, set as default.",
+                     file, ini->audio_rate);
+          ini->audio_rate = FDUPVES_AUDIO_RATE;
+        }
+    }
+
+  if (g_key_file_has_key (ini->keyfile, "_", "audio_window", NULL))
+    {
+      ini->audio_window = CLAMP (
+          g_key_file_get_integer (ini->keyfile, "_", "audio_window", NULL), 0,
+          0xfff);
+    }
+
   if (g_key_file_has_key (ini->keyfile, "_", "directories", NULL))
     {
       ini->directories = g_key_file_get_string_list (
@@ -297,12 +374,24 @@ ini_save (ini_t *ini, const gchar *file)
 
   g_key_file_set_string (ini->keyfile, "_", "ebook_viewer", ini->ebook_viewer);
 
+  g_key_file_set_boolean (ini->keyfile, "_", "image_thumbnail",
+                          ini->image_thumbnail);
+
+  g_key_file_set_boolean (ini->keyfile, "_", "video_seek_keyframe",
+                          ini->video_seek_keyframe);
+
   g_key_file_set_integer (ini->keyfile, "_", "compare_area",
                           ini->compare_area);
+  g_key_file_set_string (ini->keyfile, "_", "hash_alg",
+                         hash_phrase[ini->hash_alg]);
+  g_key_file_set_integer (ini->keyfile, "_", "hash_bits", ini->hash_bits);
   g_key_file_set_integer (ini->keyfile, "_", "filter_time_rate",
                           ini->filter_time_rate);
   g_key_file_set_integer (ini->keyfile, "_", "compare_count",
                           ini->compare_count);
+  g_key_file_set_integer (ini->keyfile, "_", "audio_rate", ini->audio_rate);
+  g_key_file_set_integer (ini->keyfile, "_", "audio_window",
+                          ini->audio_window);
 
   g_key_file_set_string_list (ini->keyfile, "_", "directories",
                               (const gchar *const *)ini->directories,
@@ -44,9 +44,11 @@ typedef struct
 
   gboolean proc_image;
   gchar **image_suffix;
+  gboolean image_thumbnail;
 
   gboolean proc_video;
   gchar **video_suffix;
+  gboolean video_seek_keyframe;
 
   gboolean proc_audio;
   gchar **audio_suffix;
@@ -56,12 +58,22 @@ typedef struct
 
   gint compare_area;
 
+  /* enum hash_type used to compare images and video frames */
+  gint hash_alg;
+  /* and its width, 64, 128 or 256 */
+  gint hash_bits;
+
   gint filter_time_rate;
 
   gboolean proc_other;
 
   gint compare_count;
 
+  /* audio is fingerprinted at audio_rate Hz, only audio_window seconds at
+   * its start, middle and end when not 0 */
+  gint audio_rate;
+  gint audio_window;
+
   gint same_image_distance;
   gint same_video_distance;
   gint same_audio_distance;
@@ -27,307 +27,158 @@
 #include <glib.h>
 #include <libavutil/mathematics.h>
 #include <math.h>
+#include <string.h>
 
-#include "cache.h"
 #include "hash.h"
-#include "image.h"
-#include "util.h"
-#include "video.h"
 
 #define FDUPVES_PHASH_LEN 32
 #define FDUPVES_DCT_LEN 8
+/* the widest low-frequency block, 16x16 for a 256 bit hash */
+#define FDUPVES_DCT_MAX 16
 
-static hash_t pixbuf_phash (GdkPixbuf *);
+static void buffer_dct_low (const unsigned char *, int, int, unsigned char *);
 
-static gboolean buffer_dct (const unsigned char *, unsigned char *, gsize);
+static void dct_basis_init ();
 
-static const gdouble *get_coefficient ();
-
-static const gdouble *get_coefficient_t ();
-
-static void matrix_mul (const gdouble *, const gdouble *, gdouble *);
+/* rows 0..15 of the 32x32 DCT-II matrix and its transpose, which is all
+ * buffer_dct_low needs to produce the top-left coefficients */
+static gdouble dct_basis[FDUPVES_DCT_MAX][FDUPVES_PHASH_LEN];
+static gdouble dct_basis_t[FDUPVES_PHASH_LEN][FDUPVES_DCT_MAX];
 
 hash_t
-image_file_phash (const char *file)
+gray_phash (const unsigned char *grays)
 {
-  GdkPixbuf *buf;
-  hash_t h;
-  GError *err;
-
-  if (g_cache)
-    {
-      if (cache_get (g_cache, file, 0, FDUPVES_IMAGE_PHASH, &h))
-        {
-          return h;
-        }
-    }
-
-  err = NULL;
-  buf = fdupves_gdkpixbuf_load_file_at_size (file, FDUPVES_PHASH_LEN,
-                                             FDUPVES_PHASH_LEN, &err);
-
-  if (err)
-    {
-      g_warning ("Load file: %s to pixbuf failed: %s", file, err->message);
-      g_error_free (err);
-      return 0;
-    }
+  hash_t hash;
 
-  h = pixbuf_phash (buf);
-  g_object_unref (buf);
+  gray_phash_bits (grays, FDUPVES_DCT_LEN, FDUPVES_DCT_LEN, &hash);
 
-  if (g_cache)
-    {
-      if (h)
-        {
-          cache_set (g_cache, file, 0, FDUPVES_IMAGE_PHASH, h);
-        }
-    }
-
-  return h;
+  return hash;
 }
 
-hash_t
-buffer_phash (const char *buffer, int size)
+/* w * h bit phash of a 32x32 gray grid from its w columns by h rows
+ * low-frequency block, into w * h / 64 words */
+void
+gray_phash_bits (const unsigned char *grays, int w, int h, hash_t *hash)
 {
-  GdkPixbuf *buf;
-  GError *err;
-  hash_t h;
+  int sum, avg, x, n;
+  unsigned char dctc[FDUPVES_DCT_MAX * FDUPVES_DCT_MAX];
 
-  err = NULL;
-  buf = gdk_pixbuf_new_from_data (
-      (const guchar *)buffer, GDK_COLORSPACE_RGB, FALSE, 8, FDUPVES_PHASH_LEN,
-      FDUPVES_PHASH_LEN, FDUPVES_PHASH_LEN * 3, NULL, &err);
-  if (err)
-    {
-      g_warning ("Load inline data to pixbuf failed: %s", err->message);
-      g_error_free (err);
-      return 0;
-    }
-
-  h = pixbuf_phash (buf);
-  g_object_unref (buf);
+  g_return_if_fail (w <= FDUPVES_DCT_MAX && h <= FDUPVES_DCT_MAX);
 
-  return h;
-}
+  buffer_dct_low (grays, w, h, dctc);
 
-hash_t
-video_time_phash (const char *file, float offset)
-{
-  hash_t h;
-  gchar buffer[FDUPVES_PHASH_LEN * FDUPVES_PHASH_LEN * 3];
-#ifdef _DEBUG
-  gchar *basename, outfile[PATH_MAX];
-#endif
-
-  if (g_cache)
+  n = w * h;
+  sum = 0;
+  for (x = 0; x < n; ++x)
     {
-      if (cache_get (g_cache, file, offset, FDUPVES_IMAGE_PHASH, &h))
-        {
-          return h;
-        }
+      sum += dctc[x];
     }
+  avg = sum / n;
 
-  video_time_screenshot (file, offset, FDUPVES_PHASH_LEN, FDUPVES_PHASH_LEN,
-                         buffer, sizeof buffer);
-#ifdef _DEBUG
-  basename = g_path_get_basename (file);
-  g_snprintf (outfile, sizeof outfile, "%s/%s-%f.png", g_get_tmp_dir (),
-              basename, offset);
-  g_free (basename);
-  video_time_screenshot_file (file, offset, FDUPVES_PHASH_LEN * 100,
-                              FDUPVES_PHASH_LEN * 100, outfile);
-#endif
-
-  h = buffer_phash (buffer, sizeof buffer);
-
-  if (g_cache)
+  memset (hash, 0, sizeof (hash_t) * FDUPVES_HASH_WORDS (n));
+  for (x = 0; x < n; ++x)
     {
-      if (h)
+      if (dctc[x] >= avg)
         {
-          cache_set (g_cache, file, offset, FDUPVES_IMAGE_PHASH, h);
+          hash[x / FDUPVES_HASH_BITS]
+              |= (((hash_t)1) << (x % FDUPVES_HASH_BITS));
         }
     }
-
-  return h;
 }
 
-static hash_t
-pixbuf_phash (GdkPixbuf *pixbuf)
+/* Only the low-frequency h x w block of C * M * C' is used by the hash, so
+ * just rows 0..h-1 of C * M (hx32x32) and their product with the first w
+ * columns of C' (hxwx32) are computed, instead of two full 32x32 matrix
+ * products.  Each coefficient is summed over k in the same order as the
+ * full product did, so the results are bit-identical to it; the inner
+ * loops run over contiguous columns so they are vectorised without
+ * reordering those sums. */
+static void
+buffer_dct_low (const unsigned char *pix, int w, int h,
+                unsigned char *out_pix)
 {
-  int width, height, rowstride, n_channels;
-  guchar *pixels, *p;
-  int sum, avg, x, y, off;
-  hash_t hash;
-  unsigned char *grays, dct[FDUPVES_PHASH_LEN * FDUPVES_PHASH_LEN],
-      dctc[FDUPVES_DCT_LEN * FDUPVES_DCT_LEN];
-
-  n_channels = gdk_pixbuf_get_n_channels (pixbuf);
-
-  g_assert (gdk_pixbuf_get_colorspace (pixbuf) == GDK_COLORSPACE_RGB);
-  g_assert (gdk_pixbuf_get_bits_per_sample (pixbuf) == 8);
+  gdouble temp[FDUPVES_DCT_MAX][FDUPVES_PHASH_LEN];
+  gdouble low[FDUPVES_DCT_MAX][FDUPVES_DCT_MAX];
+  const unsigned char *row;
+  gdouble c;
+  gsize u, v, k;
 
-  width = gdk_pixbuf_get_width (pixbuf);
-  height = gdk_pixbuf_get_height (pixbuf);
+  dct_basis_init ();
 
-  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
-  pixels = gdk_pixbuf_get_pixels (pixbuf);
-
-  grays = g_new (unsigned char, width *height);
-  off = 0;
-  for (y = 0; y < width; ++y)
+  for (u = 0; u < (gsize)h; u++)
     {
-      for (x = 0; x < height; ++x)
+      for (v = 0; v < FDUPVES_PHASH_LEN; v++)
         {
-          p = pixels + y * rowstride + x * n_channels;
-          grays[off] = (p[0] * 30 + p[1] * 59 + p[2] * 11) / 100;
-          ++off;
+          temp[u][v] = 0.0;
         }
-    }
-
-  buffer_dct (grays, dct, sizeof dct);
-
-  sum = 0;
-  off = 0;
-  for (x = 0; x < FDUPVES_DCT_LEN; ++x)
-    {
-      for (y = 0; y < FDUPVES_DCT_LEN; ++y)
+      for (k = 0; k < FDUPVES_PHASH_LEN; k++)
         {
-          sum += dct[x * FDUPVES_PHASH_LEN + y];
-          dctc[off] = dct[x * FDUPVES_PHASH_LEN + y];
-          ++off;
+          c = dct_basis[u][k];
+          row = pix + k * FDUPVES_PHASH_LEN;
+          for (v = 0; v < FDUPVES_PHASH_LEN; v++)
+            {
+              temp[u][v] += c * (gdouble)row[v];
+            }
         }
     }
-  avg = sum / off;
 
-  hash = 0;
-  for (x = 0; x < off; ++x)
+  for (u = 0; u < (gsize)h; u++)
     {
-      if (dctc[x] >= avg)
+      for (v = 0; v < (gsize)w; v++)
         {
-          hash |= (((hash_t)1) << x);
+          low[u][v] = 0.0;
         }
-    }
-
-  g_free (grays);
-
-  return hash;
-}
-
-static gboolean
-buffer_dct (const unsigned char *pix, unsigned char *out_pix, gsize out_len)
-{
-  const gdouble *quotient, *quotientT;
-  gdouble matrix[FDUPVES_PHASH_LEN * FDUPVES_PHASH_LEN],
-      temp[FDUPVES_PHASH_LEN * FDUPVES_PHASH_LEN];
-  gsize i, j;
-
-  g_assert (out_len >= FDUPVES_PHASH_LEN * FDUPVES_PHASH_LEN);
-
-  for (i = 0; i < FDUPVES_PHASH_LEN; i++)
-    {
-      for (j = 0; j < FDUPVES_PHASH_LEN; j++)
+      for (k = 0; k < FDUPVES_PHASH_LEN; k++)
         {
-          matrix[i * FDUPVES_PHASH_LEN + j]
-              = (gdouble)(pix[i * FDUPVES_PHASH_LEN + j]);
+          c = temp[u][k];
+          for (v = 0; v < (gsize)w; v++)
+            {
+              low[u][v] += c * dct_basis_t[k][v];
+            }
         }
     }
 
-  quotient = get_coefficient ();
-  quotientT = get_coefficient_t ();
-
-  matrix_mul (quotient, matrix, temp);
-  matrix_mul (temp, quotientT, matrix);
-
-  for (i = 0; i < FDUPVES_PHASH_LEN; i++)
+  for (u = 0; u < (gsize)h; u++)
     {
-      for (j = 0; j < FDUPVES_PHASH_LEN; j++)
+      for (v = 0; v < (gsize)w; v++)
         {
-          out_pix[i * FDUPVES_PHASH_LEN + j]
-              = (unsigned char)matrix[i * FDUPVES_PHASH_LEN + j];
+          out_pix[u * w + v] = (unsigned char)low[u][v];
         }
     }
-
-  return TRUE;
 }
 
-static const gdouble *
-get_coefficient_t ()
+static void
+dct_basis_init ()
 {
+  static gsize inited = 0;
   gsize i, j;
-  static gdouble *coeff_s;
-  const gdouble *c;
-
-  if (coeff_s)
-    {
-      return coeff_s;
-    }
-
-  coeff_s = g_new (gdouble, FDUPVES_PHASH_LEN * FDUPVES_PHASH_LEN);
-  g_assert (coeff_s);
-
-  c = get_coefficient ();
+  gdouble s;
 
-  for (i = 0; i < FDUPVES_PHASH_LEN; i++)
+  if (g_once_init_enter (&inited))
     {
+      s = 1.0 / sqrt (FDUPVES_PHASH_LEN);
       for (j = 0; j < FDUPVES_PHASH_LEN; j++)
         {
-          coeff_s[i * FDUPVES_PHASH_LEN + j] = c[j * FDUPVES_PHASH_LEN + i];
+          dct_basis[0][j] = s;
         }
-    }
-
-  return coeff_s;
-}
-
-static const gdouble *
-get_coefficient ()
-{
-  gsize i, j;
-  static gdouble *coeff_s = NULL;
-  gdouble s;
-
-  if (coeff_s)
-    {
-      return coeff_s;
-    }
-
-  coeff_s = g_new (gdouble, FDUPVES_PHASH_LEN * FDUPVES_PHASH_LEN);
-  g_assert (coeff_s);
-
-  s = 1.0 / sqrt (FDUPVES_PHASH_LEN);
-  for (i = 0; i < FDUPVES_PHASH_LEN; i++)
-    {
-      coeff_s[i] = s;
-    }
-  for (i = 1; i < FDUPVES_PHASH_LEN; i++)
-    {
-      for (j = 0; j < FDUPVES_PHASH_LEN; j++)
+      for (i = 1; i < FDUPVES_DCT_MAX; i++)
         {
-          coeff_s[i * FDUPVES_PHASH_LEN + j]
-              = sqrt (2.0 / FDUPVES_PHASH_LEN)
-                * cos (i * M_PI * (j + 0.5) / (gdouble)FDUPVES_PHASH_LEN);
+          for (j = 0; j < FDUPVES_PHASH_LEN; j++)
+            {
+              dct_basis[i][j]
+                  = sqrt (2.0 / FDUPVES_PHASH_LEN)
+                    * cos (i * M_PI * (j + 0.5) / (gdouble)FDUPVES_PHASH_LEN);
+            }
         }
-    }
-
-  return coeff_s;
-}
 
-static void
-matrix_mul (const gdouble *A, const gdouble *B, gdouble *matrix)
-{
-  gdouble t;
-  gsize i, j, k;
-
-  for (i = 0; i < FDUPVES_PHASH_LEN; i++)
-    {
-      for (j = 0; j < FDUPVES_PHASH_LEN; j++)
+      for (i = 0; i < FDUPVES_PHASH_LEN; i++)
         {
-          t = 0.0;
-          for (k = 0; k < FDUPVES_PHASH_LEN; k++)
+          for (j = 0; j < FDUPVES_DCT_MAX; j++)
             {
-              t += A[i * FDUPVES_PHASH_LEN + k] * B[k * FDUPVES_PHASH_LEN + j];
+              dct_basis_t[i][j] = dct_basis[j][i];
             }
-          matrix[i * FDUPVES_PHASH_LEN + j] = t;
         }
+
+      g_once_init_leave (&inited, 1);
     }
 }
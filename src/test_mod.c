@@ -26,6 +26,105 @@
 #include "../fingerprint/fingerprint.h"
 #include "audio.h"
 #include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#define PHASH_LEN 32
+
+/* reference 32x32 DCT, as phash.c computed it before the low-frequency
+ * only version, to check the hashes and time both */
+static hash_t
+phash_reference (const unsigned char *grays)
+{
+  static double c[PHASH_LEN][PHASH_LEN];
+  double m[PHASH_LEN][PHASH_LEN], t[PHASH_LEN][PHASH_LEN], s;
+  unsigned char dctc[64];
+  int i, j, k, sum, avg;
+  hash_t hash;
+
+  if (c[0][0] == 0.0)
+    {
+      for (j = 0; j < PHASH_LEN; j++)
+        c[0][j] = 1.0 / sqrt (PHASH_LEN);
+      for (i = 1; i < PHASH_LEN; i++)
+        for (j = 0; j < PHASH_LEN; j++)
+          c[i][j] = sqrt (2.0 / PHASH_LEN)
+                    * cos (i * M_PI * (j + 0.5) / (double)PHASH_LEN);
+    }
+
+  for (i = 0; i < PHASH_LEN; i++)
+    for (j = 0; j < PHASH_LEN; j++)
+      {
+        s = 0.0;
+        for (k = 0; k < PHASH_LEN; k++)
+          s += c[i][k] * grays[k * PHASH_LEN + j];
+        t[i][j] = s;
+      }
+  for (i = 0; i < PHASH_LEN; i++)
+    for (j = 0; j < PHASH_LEN; j++)
+      {
+        s = 0.0;
+        for (k = 0; k < PHASH_LEN; k++)
+          s += t[i][k] * c[j][k];
+        m[i][j] = s;
+      }
+
+  sum = 0;
+  for (i = 0; i < 8; i++)
+    for (j = 0; j < 8; j++)
+      {
+        dctc[i * 8 + j] = (unsigned char)m[i][j];
+        sum += dctc[i * 8 + j];
+      }
+  avg = sum / 64;
+
+  hash = 0;
+  for (i = 0; i < 64; i++)
+    if (dctc[i] >= avg)
+      hash |= ((hash_t)1 << i);
+
+  return hash;
+}
+
+static int
+bench_phash (int count)
+{
+  unsigned char grays[PHASH_LEN * PHASH_LEN];
+  hash_t *ref;
+  gint64 start, ref_us, new_us;
+  int i, j, diff;
+
+  ref = g_new (hash_t, count);
+  g_random_set_seed (1);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < count; ++i)
+    {
+      for (j = 0; j < PHASH_LEN * PHASH_LEN; ++j)
+        grays[j] = (i & 1) ? g_random_int_range (0, 256) : (j + i) & 0xFF;
+      ref[i] = phash_reference (grays);
+    }
+  ref_us = g_get_monotonic_time () - start;
+
+  g_random_set_seed (1);
+  diff = 0;
+  start = g_get_monotonic_time ();
+  for (i = 0; i < count; ++i)
+    {
+      for (j = 0; j < PHASH_LEN * PHASH_LEN; ++j)
+        grays[j] = (i & 1) ? g_random_int_range (0, 256) : (j + i) & 0xFF;
+      if (gray_phash (grays) != ref[i])
+        ++diff;
+    }
+  new_us = g_get_monotonic_time () - start;
+
+  printf ("phash x %d: full dct %.3fs, low dct %.3fs, %d differ\n", count,
+          ref_us / 1e6, new_us / 1e6, diff);
+
+  g_free (ref);
+
+  return diff != 0;
+}
 
 int
 main (int argc, char *argv[])
@@ -35,12 +134,26 @@ main (int argc, char *argv[])
   char buf[1000];
   int i, len;
 
+  if (argc > 1 && strcmp (argv[1], "bench-phash") == 0)
+    {
+      return bench_phash (argc > 2 ? atoi (argv[2]) : 100000);
+    }
+
+  /* check-peaks [count [file]]: the max filter peaks against those of the
+   * dilate kernel, on random matrices and the spectrogram of file */
+  if (argc > 1 && strcmp (argv[1], "check-peaks") == 0)
+    {
+      return test_fingerprint_peaks (argc > 3 ? argv[3] : NULL,
+                                     argc > 2 ? atoi (argv[2]) : 1000)
+             != 0;
+    }
+
   audio_extract_to_wav (argv[1], atoi (argv[2]), atoi (argv[3]), 16000,
                         argv[4]);
 
   test_fingerprint (argv[1]);
 
-  array = audio_fingerprint (argv[1]);
+  array = audio_fingerprint (argv[1], FDUPVES_AUDIO_RATE, 0);
   if (array)
     {
       FILE *fp = fopen ("/tmp/test1-fingerprint.dat", "w");
@@ -50,7 +163,7 @@ main (int argc, char *argv[])
         {
           hash = (audio_peak_hash *)hash_array_index (array, i);
           len = g_snprintf (buf, sizeof buf,
-                            "{\"hash\":\"%s\",\"offset\":\"%d\"},\n",
+                            "{\"hash\":\"%08x\",\"offset\":\"%d\"},\n",
                             hash->hash, hash->offset);
           fwrite (buf, 1, len, fp);
         }
@@ -140,3 +140,62 @@ is_ebook (const gchar *path)
 {
   return is_type (path, g_ini->ebook_suffix);
 }
+
+/* The threads_count cores are shared by the file workers and the decoder
+ * threads each of them opens: files queued and being hashed are counted,
+ * and a decoder opened while few files are left gets the cores the idle
+ * workers are not using. */
+static gint cpu_budget_queued;
+static gint cpu_budget_active;
+
+/* cores fdupves hashes with, the size of the file worker pools */
+int
+fd_cpu_budget (void)
+{
+  return MAX (g_ini->threads_count, 1);
+}
+
+/* count files pushed to a worker pool */
+void
+fd_cpu_budget_queue (int files)
+{
+  g_atomic_int_add (&cpu_budget_queued, files);
+}
+
+/* a worker starts on a queued file */
+void
+fd_cpu_budget_enter (void)
+{
+  g_atomic_int_add (&cpu_budget_queued, -1);
+  g_atomic_int_inc (&cpu_budget_active);
+}
+
+/* a worker is done with its file */
+void
+fd_cpu_budget_leave (void)
+{
+  g_atomic_int_add (&cpu_budget_active, -1);
+}
+
+/* forget the files a cancelled pool dropped */
+void
+fd_cpu_budget_reset (void)
+{
+  g_atomic_int_set (&cpu_budget_queued, 0);
+  g_atomic_int_set (&cpu_budget_active, 0);
+}
+
+/* threads for a decoder opened now: the budget split between the files
+ * that are, or will soon be, decoded at the same time */
+int
+fd_cpu_budget_decoder_threads (void)
+{
+  int budget, files;
+
+  budget = fd_cpu_budget ();
+  files = g_atomic_int_get (&cpu_budget_active)
+          + g_atomic_int_get (&cpu_budget_queued);
+  files = CLAMP (files, 1, budget);
+
+  return budget / files;
+}
@@ -70,4 +70,16 @@ int is_audio (const gchar *);
 
 int is_ebook (const gchar *);
 
+int fd_cpu_budget (void);
+
+void fd_cpu_budget_queue (int);
+
+void fd_cpu_budget_enter (void);
+
+void fd_cpu_budget_leave (void);
+
+void fd_cpu_budget_reset (void);
+
+int fd_cpu_budget_decoder_threads (void);
+
 #endif
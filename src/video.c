@@ -25,7 +25,9 @@
  */
 
 #include "video.h"
+#include "image.h"
 #include "util.h"
+#include "cache.h"
 
 #include <gdk-pixbuf/gdk-pixbuf.h>
 
@@ -35,11 +37,12 @@
 #include <libswscale/swscale.h>
 
 #include <glib.h>
+#include <string.h>
 
-video_info *
-video_get_info (const char *file)
+/* open the container of file and describe its best video stream */
+static gboolean
+video_probe (const char *file, cache_probe_t *probe)
 {
-  video_info *info;
   AVFormatContext *fmt_ctx = NULL;
   AVStream *stream = NULL;
   int s, ret;
@@ -48,7 +51,7 @@ video_get_info (const char *file)
   if (ret != 0)
     {
       g_warning (_ ("could not open: %s"), file);
-      return NULL;
+      return FALSE;
     }
 
   /*
@@ -56,7 +59,7 @@ video_get_info (const char *file)
     {
       g_warning (_ ("could not find stream infomations: %s"), file);
       avformat_close_input (&fmt_ctx);
-      return NULL;
+      return FALSE;
     }*/
 
   s = av_find_best_stream (fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
@@ -64,30 +67,65 @@ video_get_info (const char *file)
     {
       g_warning (_ ("could not find video stream: %s"), file);
       avformat_close_input (&fmt_ctx);
-      return NULL;
+      return FALSE;
     }
 
   stream = fmt_ctx->streams[s];
 
-  info = g_malloc0 (sizeof (video_info));
-
-  info->name = g_path_get_basename (file);
-  info->dir = g_path_get_dirname (file);
+  memset (probe, 0, sizeof (cache_probe_t));
+  probe->type = FD_VIDEO;
   if (stream->duration != AV_NOPTS_VALUE)
     {
-      info->length = (double)(stream->duration * stream->time_base.num)
-                     / stream->time_base.den;
+      probe->duration = (double)(stream->duration * stream->time_base.num)
+                        / stream->time_base.den;
     }
   else
     {
-      info->length = (double)(fmt_ctx->duration) / AV_TIME_BASE;
+      probe->duration = (double)(fmt_ctx->duration) / AV_TIME_BASE;
     }
-  info->size[0] = stream->codecpar->width;
-  info->size[1] = stream->codecpar->height;
-  info->format = avcodec_get_name (stream->codecpar->codec_id);
+  probe->width = stream->codecpar->width;
+  probe->height = stream->codecpar->height;
+  g_strlcpy (probe->codec, avcodec_get_name (stream->codecpar->codec_id),
+             sizeof probe->codec);
+  probe->bitrate = stream->codecpar->bit_rate > 0 ? stream->codecpar->bit_rate
+                                                  : fmt_ctx->bit_rate;
+  probe->streams = fmt_ctx->nb_streams;
 
   avformat_close_input (&fmt_ctx);
 
+  return TRUE;
+}
+
+/* the cached probe of file, probing it only when it changed since */
+video_info *
+video_get_info (const char *file)
+{
+  video_info *info;
+  cache_probe_t probe[1];
+
+  if (g_cache == NULL || !cache_get_probe (g_cache, file, FD_VIDEO, probe))
+    {
+      if (!video_probe (file, probe))
+        {
+          return NULL;
+        }
+      if (g_cache)
+        {
+          cache_set_probe (g_cache, file, probe);
+        }
+    }
+
+  info = g_malloc0 (sizeof (video_info));
+
+  info->name = g_path_get_basename (file);
+  info->dir = g_path_get_dirname (file);
+  info->length = probe->duration;
+  info->size[0] = probe->width;
+  info->size[1] = probe->height;
+  info->format = g_strdup (probe->codec);
+  info->bitrate = probe->bitrate;
+  info->streams = probe->streams;
+
   return info;
 }
 
@@ -96,6 +134,7 @@ video_info_free (video_info *info)
 {
   g_free (info->name);
   g_free (info->dir);
+  g_free (info->format);
   g_free (info);
 }
 
@@ -116,167 +155,479 @@ video_get_length (const char *file)
   return length;
 }
 
-int
-video_time_screenshot (const char *file, int time, int width, int height,
-                       char *buffer, int buf_len)
+struct video_session_s
 {
-  AVFormatContext *format_ctx = NULL;
-  AVCodecContext *codec_ctx = NULL;
-  const AVCodec *codec = NULL;
-  AVFrame *frame, *frame_rgb;
+  gchar *file;
+  AVFormatContext *format_ctx;
+  AVCodecContext *codec_ctx;
+  int stream;
+  AVFrame *frame;
+  AVFrame *frame_rgb;
   AVPacket *packet;
-  struct SwsContext *img_convert_ctx = NULL;
-  int s, ret, bytes;
-  int64_t seek_target;
+  struct SwsContext *sws_ctx;
+
+  /* seek back to the nearest keyframe and decode only keyframes */
+  gboolean keyframe;
+  /* read on from the last frame to a later time instead of seeking, with
+   * frame threads, see video_session_open_sequential */
+  gboolean sequential;
+  /* threads the decoder was opened with */
+  int threads;
+  /* time of the last frame returned, negative when the next call seeks */
+  double last;
+};
+
+/* (re)open the decoder of session with the threads the budget has for it
+ * now */
+static gboolean
+video_session_codec_open (video_session *session)
+{
+  const AVCodec *codec;
+  AVStream *stream;
+
+  stream = session->format_ctx->streams[session->stream];
+  avcodec_free_context (&session->codec_ctx);
+  session->last = -1;
 
-  if (avformat_open_input (&format_ctx, file, NULL, NULL) != 0)
+  codec = avcodec_find_decoder (stream->codecpar->codec_id);
+  if (codec == NULL)
     {
-      g_warning (_ ("could not open: %s"), file);
-      return -1;
+      g_warning (_ ("Unsupported codec: %s"), session->file);
+      return FALSE;
     }
 
-  /*
-  if (avformat_find_stream_info (format_ctx, NULL) < 0)
+  session->codec_ctx = avcodec_alloc_context3 (codec);
+  if (session->codec_ctx == NULL
+      || avcodec_parameters_to_context (session->codec_ctx, stream->codecpar)
+             < 0)
     {
-      g_warning (_ ("could not find stream infomations: %s"), file);
-      avformat_close_input (&format_ctx);
-      return -1;
-    }*/
+      g_warning (_ ("Memory error: %s"), session->file);
+      return FALSE;
+    }
+  session->codec_ctx->pkt_timebase = stream->time_base;
+  session->threads = fd_cpu_budget_decoder_threads ();
+  session->codec_ctx->thread_count = session->threads;
+  /* frame threads would decode thread_count frames after every seek to
+   * return the one sampled, only slices share the work of a single frame;
+   * a sequential session seeks only once, so its frames go to threads
+   * too, which is what scales single slice H.264 and HEVC */
+  session->codec_ctx->thread_type
+      = session->sequential ? FF_THREAD_FRAME | FF_THREAD_SLICE
+                            : FF_THREAD_SLICE;
+  if (session->keyframe)
+    {
+      session->codec_ctx->skip_frame = AVDISCARD_NONKEY;
+    }
 
-  s = av_find_best_stream (format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
-  if (s < 0)
+  if (avcodec_open2 (session->codec_ctx, codec, NULL) < 0)
+    {
+      g_warning (_ ("Could not open codec: %s"), session->file);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static video_session *
+video_session_new (const char *file, gboolean keyframe, gboolean sequential)
+{
+  video_session *session;
+
+  session = g_malloc0 (sizeof (video_session));
+  session->file = g_strdup (file);
+  session->keyframe = keyframe;
+  session->sequential = sequential;
+
+  if (avformat_open_input (&session->format_ctx, file, NULL, NULL) != 0)
+    {
+      g_warning (_ ("could not open: %s"), file);
+      video_session_close (session);
+      return NULL;
+    }
+
+  session->stream = av_find_best_stream (session->format_ctx,
+                                         AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+  if (session->stream < 0)
     {
       g_warning (_ ("could not find video stream: %s"), file);
-      avformat_close_input (&format_ctx);
-      return -1;
+      video_session_close (session);
+      return NULL;
     }
 
-  codec = avcodec_find_decoder (format_ctx->streams[s]->codecpar->codec_id);
-  if (codec == NULL)
+  if (!video_session_codec_open (session))
     {
-      g_warning (_ ("Unsupported codec: %s"), file);
-      avcodec_free_context (&codec_ctx);
-      avformat_close_input (&format_ctx);
-      return -1;
+      video_session_close (session);
+      return NULL;
     }
 
-  codec_ctx = avcodec_alloc_context3 (codec);
-  if (codec_ctx == NULL)
+  session->frame = av_frame_alloc ();
+  session->frame_rgb = av_frame_alloc ();
+  session->packet = av_packet_alloc ();
+  if (session->frame == NULL || session->frame_rgb == NULL
+      || session->packet == NULL)
     {
       g_warning (_ ("Memory error: %s"), file);
-      avformat_close_input (&format_ctx);
-      return -1;
+      video_session_close (session);
+      return NULL;
     }
 
-  ret = avcodec_parameters_to_context (codec_ctx,
-                                       format_ctx->streams[s]->codecpar);
-  if (ret < 0)
+  return session;
+}
+
+video_session *
+video_session_open (const char *file, gboolean keyframe)
+{
+  return video_session_new (file, keyframe, FALSE);
+}
+
+video_session *
+video_session_open_sequential (const char *file)
+{
+  return video_session_new (file, TRUE, TRUE);
+}
+
+void
+video_session_close (video_session *session)
+{
+  sws_freeContext (session->sws_ctx);
+  av_packet_free (&session->packet);
+  av_frame_free (&session->frame_rgb);
+  av_frame_free (&session->frame);
+  avcodec_free_context (&session->codec_ctx);
+  avformat_close_input (&session->format_ctx);
+  g_free (session->file);
+  g_free (session);
+}
+
+/* seek to time and decode the first frame from there into session->frame,
+ * the decoder of the session is kept for the next call; sampled, if not
+ * NULL, is set to the time of that frame in seconds, which is the keyframe
+ * at or before time in keyframe mode, or the keyframe at or after it when
+ * forward.  A sequential session asked forward for a time after its last
+ * frame reads on to the first frame at or after time instead. */
+static gboolean
+video_session_decode (video_session *session, int time, gboolean forward,
+                      double *sampled)
+{
+  AVStream *stream;
+  AVCodecContext *codec_ctx;
+  int ret;
+  int64_t seek_target, pts;
+  double t;
+  gboolean reading;
+
+  /* the files queued when the decoder was opened are done, a seek drops
+   * what it holds anyway, so take the threads that are free now */
+  if (fd_cpu_budget_decoder_threads () > session->threads
+      && !video_session_codec_open (session))
     {
-      g_warning (_ ("Memory error: %s"), file);
-      avcodec_free_context (&codec_ctx);
-      avformat_close_input (&format_ctx);
-      return -1;
+      return FALSE;
     }
 
-  codec_ctx->pkt_timebase = format_ctx->streams[s]->time_base;
-  // av_codec_set_pkt_timebase (codec_ctx, format_ctx->streams[s]->time_base);
+  stream = session->format_ctx->streams[session->stream];
+  codec_ctx = session->codec_ctx;
 
-  frame = av_frame_alloc ();
-  if (frame == NULL)
+  reading = session->sequential && forward && session->last >= 0
+            && time > session->last;
+  if (!reading)
     {
-      avcodec_free_context (&codec_ctx);
-      avformat_close_input (&format_ctx);
-      return -1;
+      seek_target = av_rescale (time, stream->time_base.den,
+                                stream->time_base.num);
+      if (forward)
+        {
+          avformat_seek_file (session->format_ctx, session->stream,
+                              seek_target, seek_target, INT64_MAX, 0);
+        }
+      else if (session->keyframe)
+        {
+          /* the decoder drops everything but keyframes, so the first frame
+           * out is the keyframe the demuxer landed on */
+          avformat_seek_file (session->format_ctx, session->stream,
+                              INT64_MIN, seek_target, seek_target,
+                              AVSEEK_FLAG_BACKWARD);
+        }
+      else
+        {
+          avformat_seek_file (session->format_ctx, session->stream, 0,
+                              seek_target, seek_target, AVSEEK_FLAG_FRAME);
+        }
+      /* drop what the previous screenshot left in the decoder */
+      avcodec_flush_buffers (codec_ctx);
     }
-  frame_rgb = av_frame_alloc ();
-  if (frame_rgb == NULL)
+
+  /* frame threads hold frames back, take those out before reading more,
+   * and drain them at the end of the file */
+  for (;;)
     {
-      av_frame_free (&frame);
-      avcodec_free_context (&codec_ctx);
-      avformat_close_input (&format_ctx);
-      return -1;
+      ret = avcodec_receive_frame (codec_ctx, session->frame);
+      if (ret == 0)
+        {
+          pts = session->frame->best_effort_timestamp;
+          if (pts == AV_NOPTS_VALUE)
+            {
+              pts = session->frame->pts;
+            }
+          t = pts == AV_NOPTS_VALUE ? time : pts * av_q2d (stream->time_base);
+          if (reading && t < time)
+            {
+              av_frame_unref (session->frame);
+              continue;
+            }
+
+          session->last = t;
+          if (sampled)
+            {
+              *sampled = t;
+            }
+          return TRUE;
+        }
+
+      if (ret != AVERROR (EAGAIN))
+        {
+          if (ret != AVERROR_EOF)
+            {
+              g_warning (_ ("Cannot receive frame from context"));
+            }
+          session->last = -1;
+          return FALSE;
+        }
+
+      if (av_read_frame (session->format_ctx, session->packet) < 0)
+        {
+          avcodec_send_packet (codec_ctx, NULL);
+          continue;
+        }
+
+      if (session->packet->stream_index == session->stream)
+        {
+          avcodec_send_packet (codec_ctx, session->packet);
+        }
+      av_packet_unref (session->packet);
     }
-  bytes = av_image_fill_arrays (frame_rgb->data, frame_rgb->linesize,
+}
+
+/* seek to time and scale the first frame decoded from there into buffer,
+ * the scaler of the session is kept for the next call; sampled as by
+ * video_session_decode; return -1 when no frame could be decoded */
+int
+video_session_screenshot (video_session *session, int time, int width,
+                          int height, char *buffer, int buf_len,
+                          double *sampled)
+{
+  AVCodecContext *codec_ctx;
+  int bytes;
+
+  codec_ctx = session->codec_ctx;
+
+  bytes = av_image_fill_arrays (session->frame_rgb->data,
+                                session->frame_rgb->linesize,
                                 (uint8_t *)buffer, AV_PIX_FMT_RGB24, width,
                                 height, 1);
   if (buf_len < bytes)
     {
-      av_frame_free (&frame);
-      av_frame_free (&frame_rgb);
-      avcodec_free_context (&codec_ctx);
-      avformat_close_input (&format_ctx);
       return -1;
     }
 
-  seek_target = av_rescale (time, format_ctx->streams[s]->time_base.den,
-                            format_ctx->streams[s]->time_base.num);
-  avformat_seek_file (format_ctx, s, 0, seek_target, seek_target,
-                      AVSEEK_FLAG_FRAME);
+  if (!video_session_decode (session, time, FALSE, sampled))
+    {
+      return -1;
+    }
 
-  packet = av_packet_alloc ();
-  if (packet == NULL)
+  session->sws_ctx = sws_getCachedContext (
+      session->sws_ctx, codec_ctx->width, codec_ctx->height,
+      codec_ctx->pix_fmt, width, height, AV_PIX_FMT_RGB24, SWS_FAST_BILINEAR,
+      NULL, NULL, NULL);
+  if (!session->sws_ctx)
     {
-      av_frame_free (&frame);
-      av_frame_free (&frame_rgb);
-      avcodec_free_context (&codec_ctx);
-      avformat_close_input (&format_ctx);
+      g_warning (_ ("Cannot initialize sws conversion context"));
+      av_frame_unref (session->frame);
       return -1;
     }
 
-  while (av_read_frame (format_ctx, packet) >= 0)
+  sws_scale (session->sws_ctx, (const uint8_t *const *)session->frame->data,
+             session->frame->linesize, 0, codec_ctx->height,
+             session->frame_rgb->data, session->frame_rgb->linesize);
+  av_frame_unref (session->frame);
+
+  return bytes;
+}
+
+/* formats whose first plane is 8 bit luma */
+static gboolean
+video_frame_has_luma8 (int format)
+{
+  switch (format)
     {
-      if (packet->stream_index != s)
-        {
-          av_packet_unref (packet);
-          continue;
-        }
+    case AV_PIX_FMT_GRAY8:
+    case AV_PIX_FMT_YUV410P:
+    case AV_PIX_FMT_YUV411P:
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUV422P:
+    case AV_PIX_FMT_YUV440P:
+    case AV_PIX_FMT_YUV444P:
+    case AV_PIX_FMT_YUVJ411P:
+    case AV_PIX_FMT_YUVJ420P:
+    case AV_PIX_FMT_YUVJ422P:
+    case AV_PIX_FMT_YUVJ440P:
+    case AV_PIX_FMT_YUVJ444P:
+    case AV_PIX_FMT_YUVA420P:
+    case AV_PIX_FMT_YUVA422P:
+    case AV_PIX_FMT_YUVA444P:
+    case AV_PIX_FMT_NV12:
+    case AV_PIX_FMT_NV21:
+    case AV_PIX_FMT_NV16:
+    case AV_PIX_FMT_NV24:
+      return TRUE;
+
+    default:
+      return FALSE;
+    }
+}
 
-      if (avcodec_send_packet (codec_ctx, packet) != 0)
-        {
-          av_packet_unref (packet);
-          continue;
-        }
+/* formats that are full range whatever the frame says */
+static gboolean
+video_frame_full_range (int format)
+{
+  switch (format)
+    {
+    case AV_PIX_FMT_GRAY8:
+    case AV_PIX_FMT_YUVJ411P:
+    case AV_PIX_FMT_YUVJ420P:
+    case AV_PIX_FMT_YUVJ422P:
+    case AV_PIX_FMT_YUVJ440P:
+    case AV_PIX_FMT_YUVJ444P:
+      return TRUE;
+
+    default:
+      return FALSE;
+    }
+}
+
+static void
+video_sws_free (struct SwsContext **sws_ctx)
+{
+  sws_freeContext (*sws_ctx);
+  g_free (sws_ctx);
+}
 
-      av_packet_unref (packet);
+/* gray scaler for the frames without 8 bit luma, one per hashing thread */
+static GPrivate video_sws_private
+    = G_PRIVATE_INIT ((GDestroyNotify)video_sws_free);
+
+/* area average the luma of the frame just decoded into the width x height
+ * luma grid and release the frame */
+static gboolean
+video_session_frame_luma (video_session *session, int width, int height,
+                          guchar *luma)
+{
+  AVFrame *frame;
+  struct SwsContext **sws_ctx;
+  uint8_t *dst[4];
+  int dst_linesize[4];
+  int i, v;
+  gboolean limited;
+
+  frame = session->frame;
+
+  limited = frame->color_range != AVCOL_RANGE_JPEG;
+  if (video_frame_has_luma8 (frame->format))
+    {
+      limited = limited && !video_frame_full_range (frame->format);
 
-      ret = avcodec_receive_frame (codec_ctx, frame);
-      if (ret == AVERROR (EAGAIN))
+      /* only the Y plane is read, every source pixel counts once */
+      fdupves_luma_scale (frame->data[0], frame->width, frame->height,
+                          frame->linesize[0], luma, width, height);
+    }
+  else
+    {
+      sws_ctx = g_private_get (&video_sws_private);
+      if (sws_ctx == NULL)
         {
-          continue;
+          sws_ctx = g_new0 (struct SwsContext *, 1);
+          g_private_set (&video_sws_private, sws_ctx);
         }
 
-      if (ret != 0)
+      *sws_ctx = sws_getCachedContext (*sws_ctx, frame->width, frame->height,
+                                       frame->format, width, height,
+                                       AV_PIX_FMT_GRAY8, SWS_AREA, NULL,
+                                       NULL, NULL);
+      if (*sws_ctx == NULL)
         {
-          g_warning (_ ("Cannot receive frame from context"));
-          bytes = -1;
-          break;
+          g_warning (_ ("Cannot initialize sws conversion context"));
+          av_frame_unref (frame);
+          return FALSE;
         }
 
-      img_convert_ctx = sws_getCachedContext (
-          img_convert_ctx, codec_ctx->width, codec_ctx->height,
-          codec_ctx->pix_fmt, width, height, AV_PIX_FMT_RGB24,
-          SWS_FAST_BILINEAR, NULL, NULL, NULL);
-      if (!img_convert_ctx)
+      av_image_fill_arrays (dst, dst_linesize, luma, AV_PIX_FMT_GRAY8, width,
+                            height, 1);
+      sws_scale (*sws_ctx, (const uint8_t *const *)frame->data,
+                 frame->linesize, 0, frame->height, dst, dst_linesize);
+
+      /* swscale already expands limited range to full gray */
+      limited = FALSE;
+    }
+  av_frame_unref (frame);
+
+  /* stretch 16..235 video levels so the same picture hashes the same
+   * whatever range it was encoded in */
+  if (limited)
+    {
+      for (i = 0; i < width * height; ++i)
         {
-          g_warning (_ ("Cannot initialize sws conversion context"));
-          bytes = -1;
-          break;
+          v = ((int)luma[i] - 16) * 255 / 219;
+          luma[i] = CLAMP (v, 0, 255);
         }
+    }
+
+  return TRUE;
+}
+
+/* seek to time and area average the luma of the first frame decoded from
+ * there into the width x height luma grid; sampled as by
+ * video_session_decode; return FALSE when no frame could be decoded */
+gboolean
+video_session_luma (video_session *session, int time, int width, int height,
+                    guchar *luma, double *sampled)
+{
+  if (!video_session_decode (session, time, FALSE, sampled))
+    {
+      return FALSE;
+    }
 
-      sws_scale (img_convert_ctx, (const uint8_t *const *)frame->data,
-                 frame->linesize, 0, codec_ctx->height, frame_rgb->data,
-                 frame_rgb->linesize);
-      sws_freeContext (img_convert_ctx);
-      break;
+  return video_session_frame_luma (session, width, height, luma);
+}
+
+/* as video_session_luma, of the first keyframe at or after time, so
+ * walking a file with increasing times decodes each keyframe at most
+ * once; return FALSE past the last keyframe */
+gboolean
+video_session_next_luma (video_session *session, int time, int width,
+                         int height, guchar *luma, double *sampled)
+{
+  if (!video_session_decode (session, time, TRUE, sampled))
+    {
+      return FALSE;
     }
 
-  av_packet_free (&packet);
-  av_frame_free (&frame_rgb);
-  av_frame_free (&frame);
+  return video_session_frame_luma (session, width, height, luma);
+}
+
+int
+video_time_screenshot (const char *file, int time, int width, int height,
+                       char *buffer, int buf_len)
+{
+  video_session *session;
+  int bytes;
 
-  avcodec_free_context (&codec_ctx);
+  session = video_session_open (file, FALSE);
+  if (session == NULL)
+    {
+      return -1;
+    }
 
-  avformat_close_input (&format_ctx);
+  bytes = video_session_screenshot (session, time, width, height, buffer,
+                                    buf_len, NULL);
+  video_session_close (session);
 
   return bytes;
 }
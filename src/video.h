@@ -27,6 +27,8 @@
 #ifndef _FDUPVES_VIDEO_H_
 #define _FDUPVES_VIDEO_H_
 
+#include <glib.h>
+
 typedef struct
 {
   /* filename */
@@ -36,13 +38,19 @@ typedef struct
   char *dir;
 
   /* Format */
-  const char *format;
+  char *format;
 
   /* Duration */
   double length;
 
   /* Size */
   int size[2];
+
+  /* Bitrate */
+  gint64 bitrate;
+
+  /* Streams */
+  int streams;
 } video_info;
 
 video_info *video_get_info (const char *file);
@@ -51,6 +59,29 @@ void video_info_free (video_info *info);
 
 int video_get_length (const char *file);
 
+/* an open file with its decoder, to take several screenshots in a row */
+typedef struct video_session_s video_session;
+
+video_session *video_session_open (const char *file, gboolean keyframe);
+
+/* keyframes only, walked in order with video_session_next_luma: a later
+ * time reads on from the last keyframe instead of seeking, so the decoder
+ * runs on frame threads */
+video_session *video_session_open_sequential (const char *file);
+
+void video_session_close (video_session *session);
+
+int video_session_screenshot (video_session *session, int time, int width,
+                              int height, char *buffer, int buf_len,
+                              double *sampled);
+
+gboolean video_session_luma (video_session *session, int time, int width,
+                             int height, guchar *luma, double *sampled);
+
+gboolean video_session_next_luma (video_session *session, int time,
+                                  int width, int height, guchar *luma,
+                                  double *sampled);
+
 int video_time_screenshot (const char *file, int time, int width, int height,
                            char *buffer, int buf_len);
 